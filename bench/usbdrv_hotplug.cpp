@@ -0,0 +1,181 @@
+/*
+ * usbdrv_hotplug - probe and disconnect latency under hotplug churn
+ *
+ * Unbinds and rebinds one interface from the usbdev driver through sysfs,
+ * which runs disconnect() and probe() synchronously, and times each step of
+ * the cycle.  A reader is left blocked in read() across every unbind, so
+ * the disconnect has I/O to cancel.  After the bind it times how long the
+ * /dev node takes to appear and the first read() to return data; load the
+ * driver with rx_prearm=1 to have data taken in before that open.  Needs
+ * root and a device that sends data on its own.
+ *
+ *	usbdrv_hotplug -i 1-1:1.0 [-n cycles] [-s bytes]
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "usbdrv.hpp"
+
+namespace {
+
+const std::string driver_dir = "/sys/bus/usb/drivers/usbdev/";
+
+/* write @intf to a driver's bind or unbind file; returns once the driver is done */
+bool sysfs_write(const std::string &file, const std::string &intf)
+{
+	int fd = open(file.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		std::perror(file.c_str());
+		return false;
+	}
+	bool ok = write(fd, intf.data(), intf.size()) == ssize_t(intf.size());
+	if (!ok)
+		std::perror(file.c_str());
+	close(fd);
+	return ok;
+}
+
+/* /dev node of @intf, from its usbmisc class entry, or "" if it has none yet */
+std::string node_of(const std::string &intf)
+{
+	std::error_code ec;
+	for (auto &e : std::filesystem::directory_iterator("/sys/bus/usb/devices/" + intf + "/usbmisc", ec))
+		return "/dev/" + e.path().filename().string();
+	return {};
+}
+
+std::uint64_t sysfs_u64(const std::string &intf, const char *attr)
+{
+	std::ifstream f("/sys/bus/usb/devices/" + intf + "/" + attr);
+	std::uint64_t v = 0;
+	f >> v;
+	return v;
+}
+
+/* the node, once it exists and opens; "" after @timeout_ns */
+std::string wait_node(const std::string &intf, std::uint64_t timeout_ns, int &fd)
+{
+	std::uint64_t start = usbdrv::now_ns();
+	do {
+		std::string node = node_of(intf);
+		if (!node.empty()) {
+			fd = open(node.c_str(), O_RDWR | O_CLOEXEC);
+			if (fd >= 0)
+				return node;
+		}
+		usleep(100);
+	} while (usbdrv::now_ns() - start < timeout_ns);
+	return {};
+}
+
+struct Phase {
+	const char *name;
+	usbdrv::Histogram h;
+};
+
+void report(const std::vector<Phase> &phases)
+{
+	std::printf("%-22s %8s %10s %10s %10s %10s\n", "phase", "count", "min_us", "p50_us", "p99_us", "max_us");
+	for (auto &p : phases)
+		std::printf("%-22s %8llu %10.1f %10.1f %10.1f %10.1f\n", p.name, (unsigned long long)p.h.count(),
+			    double(p.h.min()) / 1e3, double(p.h.percentile(0.5)) / 1e3,
+			    double(p.h.percentile(0.99)) / 1e3, double(p.h.max()) / 1e3);
+}
+
+[[noreturn]] void usage(const char *prog)
+{
+	std::fprintf(stderr, "usage: %s -i interface [-n cycles] [-s bytes]\n", prog);
+	std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::string intf;
+	unsigned cycles = 20;
+	std::size_t size = 4096;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:n:s:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			intf = optarg;
+			break;
+		case 'n':
+			cycles = std::max(1u, unsigned(std::strtoul(optarg, nullptr, 0)));
+			break;
+		case 's':
+			size = std::max<std::size_t>(1, std::strtoul(optarg, nullptr, 0));
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (intf.empty())
+		usage(argv[0]);
+
+	enum { UNBIND, READER_EXIT, BIND, DRIVER_PROBE, NODE, FIRST_DATA, DRIVER_FIRST_BYTE };
+	std::vector<Phase> phases = {
+		{"unbind (disconnect)", {}}, {"blocked read exit", {}}, {"bind (probe)", {}}, {"driver probe_us", {}},
+		{"bind to node open", {}}, {"bind to first data", {}}, {"driver first byte", {}},
+	};
+	std::vector<std::byte> buf(size);
+
+	int fd = -1;
+	if (wait_node(intf, 0, fd).empty()) {
+		std::fprintf(stderr, "%s: not bound to usbdev\n", intf.c_str());
+		return 1;
+	}
+	for (unsigned i = 0; i < cycles; ++i) {
+		std::uint64_t reader_done = 0;
+		std::thread reader([&] {
+			while (read(fd, buf.data(), buf.size()) >= 0 || errno == ETIMEDOUT || errno == EINTR)
+				;
+			reader_done = usbdrv::now_ns();
+		});
+		usleep(10000);	/* let the reader block */
+
+		std::uint64_t t0 = usbdrv::now_ns();
+		if (!sysfs_write(driver_dir + "unbind", intf))
+			return 1;
+		std::uint64_t t1 = usbdrv::now_ns();
+		reader.join();
+		close(fd);
+		phases[UNBIND].h.record(t1 - t0);
+		phases[READER_EXIT].h.record(reader_done - t0);
+
+		std::uint64_t t2 = usbdrv::now_ns();
+		if (!sysfs_write(driver_dir + "bind", intf))
+			return 1;
+		std::uint64_t t3 = usbdrv::now_ns();
+		phases[BIND].h.record(t3 - t2);
+		phases[DRIVER_PROBE].h.record(sysfs_u64(intf, "probe_us") * 1000);
+
+		fd = -1;
+		if (wait_node(intf, 5000000000ull, fd).empty()) {
+			std::fprintf(stderr, "%s: no device node after bind\n", intf.c_str());
+			return 1;
+		}
+		phases[NODE].h.record(usbdrv::now_ns() - t2);
+		ssize_t n = read(fd, buf.data(), buf.size());
+		if (n > 0) {
+			phases[FIRST_DATA].h.record(usbdrv::now_ns() - t2);
+			phases[DRIVER_FIRST_BYTE].h.record(sysfs_u64(intf, "probe_first_byte_us") * 1000);
+		}
+	}
+	close(fd);
+	report(phases);
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * usbdrv_mt - throughput of one /dev/usbdrv%d fd shared by many threads
+ *
+ * Runs the same load with 1, 2, 4, ... threads doing blocking read() or
+ * write() on a single fd and prints throughput, the speedup over one thread
+ * and per-call latency for each step.  Point it at a loopback device (one
+ * whose bulk-in returns what bulk-out sends, or an endless source/sink) so
+ * both directions have something to do.
+ *
+ *	usbdrv_mt [-d /dev/usbdrv0] [-m read|write|rw] [-t max_threads]
+ *		  [-s bytes] [-T seconds]
+ */
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "usbdrv.hpp"
+
+namespace {
+
+enum class Mode { read, write, rw };
+
+struct Worker {
+	usbdrv::Histogram lat;
+	std::uint64_t bytes = 0;
+	std::uint64_t timeouts = 0;
+	int error = 0;
+};
+
+/* one blocking call, timed; false once the thread has to give up */
+bool call(int fd, bool writer, std::vector<std::byte> &buf, Worker &w)
+{
+	std::uint64_t start = usbdrv::now_ns();
+	ssize_t n = writer ? ::write(fd, buf.data(), buf.size()) : ::read(fd, buf.data(), buf.size());
+	if (n < 0) {
+		if (errno == ETIMEDOUT)
+			w.timeouts++;
+		else if (errno != EINTR)
+			w.error = errno;
+		return !w.error;
+	}
+	w.lat.record(usbdrv::now_ns() - start);
+	w.bytes += std::uint64_t(n);
+	return true;
+}
+
+void work(int fd, Mode mode, std::size_t size, const std::atomic<bool> &stop, Worker &w)
+{
+	std::vector<std::byte> buf(size);
+	while (!stop.load(std::memory_order_relaxed)) {
+		/* rw sends a block and reads one back, for a loopback device */
+		if (mode != Mode::read && !call(fd, true, buf, w))
+			return;
+		if (mode != Mode::write && !call(fd, false, buf, w))
+			return;
+	}
+}
+
+struct Step {
+	double mbps;
+	usbdrv::Histogram lat;
+	std::uint64_t timeouts;
+	int error;
+};
+
+Step run(int fd, Mode mode, unsigned threads, std::size_t size, unsigned seconds)
+{
+	std::atomic<bool> stop{false};
+	std::vector<Worker> workers(threads);
+	std::vector<std::thread> pool;
+	std::uint64_t start = usbdrv::now_ns();
+	for (unsigned i = 0; i < threads; ++i)
+		pool.emplace_back(work, fd, mode, size, std::cref(stop), std::ref(workers[i]));
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	stop = true;
+	for (auto &t : pool)
+		t.join();
+	double secs = double(usbdrv::now_ns() - start) / 1e9;
+
+	Step step{0, {}, 0, 0};
+	std::uint64_t bytes = 0;
+	for (auto &w : workers) {
+		bytes += w.bytes;
+		step.lat.merge(w.lat);
+		step.timeouts += w.timeouts;
+		if (w.error && !step.error)
+			step.error = w.error;
+	}
+	step.mbps = double(bytes) / secs / 1e6;
+	return step;
+}
+
+[[noreturn]] void usage(const char *prog)
+{
+	std::fprintf(stderr, "usage: %s [-d dev] [-m read|write|rw] [-t max_threads] [-s bytes] [-T seconds]\n", prog);
+	std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::string path = "/dev/usbdrv0";
+	Mode mode = Mode::rw;
+	unsigned max_threads = 8, seconds = 2;
+	std::size_t size = 16384;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:t:s:T:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			path = optarg;
+			break;
+		case 'm':
+			if (!std::strcmp(optarg, "read"))
+				mode = Mode::read;
+			else if (!std::strcmp(optarg, "write"))
+				mode = Mode::write;
+			else if (!std::strcmp(optarg, "rw"))
+				mode = Mode::rw;
+			else
+				usage(argv[0]);
+			break;
+		case 't':
+			max_threads = std::max(1u, unsigned(std::strtoul(optarg, nullptr, 0)));
+			break;
+		case 's':
+			size = std::max<std::size_t>(1, std::strtoul(optarg, nullptr, 0));
+			break;
+		case 'T':
+			seconds = std::max(1u, unsigned(std::strtoul(optarg, nullptr, 0)));
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		std::perror(path.c_str());
+		return 1;
+	}
+	/* short timeouts so the threads notice the end of a step */
+	usbdrv_params params{};
+	if (ioctl(fd, USBDRV_IOC_GET_PARAMS, &params) == 0) {
+		params.version = USBDRV_ABI_VERSION;
+		params.read_timeout_ms = 200;
+		params.write_timeout_ms = 200;
+		ioctl(fd, USBDRV_IOC_SET_PARAMS, &params);
+	}
+
+	std::printf("%-8s %10s %8s %10s %10s %10s %9s\n", "threads", "MB/s", "speedup", "p50_us", "p99_us", "max_us",
+		    "timeouts");
+	double base = 0;
+	for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+		Step s = run(fd, mode, threads, size, seconds);
+		if (threads == 1)
+			base = s.mbps;
+		std::printf("%-8u %10.1f %8.2f %10.1f %10.1f %10.1f %9llu\n", threads, s.mbps, base > 0 ? s.mbps / base : 0.0,
+			    double(s.lat.percentile(0.5)) / 1e3, double(s.lat.percentile(0.99)) / 1e3,
+			    double(s.lat.max()) / 1e3, (unsigned long long)s.timeouts);
+		if (s.error) {
+			std::fprintf(stderr, "%s: %s\n", path.c_str(), std::strerror(s.error));
+			close(fd);
+			return 1;
+		}
+	}
+	close(fd);
+	return 0;
+}
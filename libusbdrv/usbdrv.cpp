@@ -0,0 +1,663 @@
+/*
+ * usbdrv.cpp - asynchronous C++20 client for the usbdev driver
+ */
+#include "usbdrv.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace usbdrv {
+
+namespace {
+
+[[noreturn]] void throw_errno(const char *what, int err = errno)
+{
+	throw std::system_error(err, std::generic_category(), what);
+}
+
+std::uint64_t since(std::uint64_t start)
+{
+	return now_ns() - start;
+}
+
+constexpr std::size_t page_size = 4096;
+
+} // namespace
+
+std::uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return std::uint64_t(ts.tv_sec) * 1000000000u + std::uint64_t(ts.tv_nsec);
+}
+
+namespace detail {
+
+struct Pending {
+	XferResult *result;
+	std::size_t *outstanding;
+	std::uint64_t submitted_ns;
+};
+
+} // namespace detail
+
+/* Histogram */
+
+void Histogram::record(std::uint64_t ns)
+{
+	buckets_[ns ? std::bit_width(ns) - 1 : 0]++;
+	count_++;
+	sum_ += ns;
+	min_ = std::min(min_, ns);
+	max_ = std::max(max_, ns);
+}
+
+void Histogram::reset()
+{
+	*this = Histogram();
+}
+
+void Histogram::merge(const Histogram &other)
+{
+	for (std::size_t i = 0; i < buckets_.size(); ++i)
+		buckets_[i] += other.buckets_[i];
+	count_ += other.count_;
+	sum_ += other.sum_;
+	min_ = std::min(min_, other.min_);
+	max_ = std::max(max_, other.max_);
+}
+
+std::uint64_t Histogram::percentile(double p) const
+{
+	std::uint64_t want, seen = 0;
+	if (!count_)
+		return 0;
+	want = std::max<std::uint64_t>(1, std::uint64_t(p * double(count_) + 0.5));
+	for (std::size_t i = 0; i < buckets_.size(); ++i) {
+		seen += buckets_[i];
+		if (seen >= want)
+			return std::min(max_, (std::uint64_t(2) << i) - 1);
+	}
+	return max_;
+}
+
+void Metrics::reset()
+{
+	read.reset();
+	write.reset();
+	xfer.reset();
+	delivery.reset();
+}
+
+/* Reactor */
+
+Reactor::Reactor()
+{
+	epfd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd_ < 0)
+		throw_errno("epoll_create1");
+	efd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd_ < 0) {
+		int err = errno;
+		close(epfd_);
+		throw_errno("eventfd", err);
+	}
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = efd_;
+	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, efd_, &ev) < 0) {
+		int err = errno;
+		close(efd_);
+		close(epfd_);
+		throw_errno("epoll_ctl", err);
+	}
+}
+
+Reactor::~Reactor()
+{
+	close(efd_);
+	close(epfd_);
+}
+
+void Reactor::add(int fd)
+{
+	/* edge triggered: whoever gets EAGAIN parks, the next wakeup resumes it */
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+		throw_errno("epoll_ctl");
+	waiters_[fd];
+}
+
+void Reactor::remove(int fd)
+{
+	epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+	waiters_.erase(fd);
+}
+
+void Reactor::FdAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	auto &w = reactor.waiters_.at(fd);
+	(out ? w.out : w.in).push_back(this);
+	handle = h;
+}
+
+Reactor::FdAwaiter::~FdAwaiter()
+{
+	if (!handle)
+		return;
+	/* the coroutine was destroyed while parked: forget it */
+	auto it = reactor.waiters_.find(fd);
+	if (it != reactor.waiters_.end()) {
+		std::erase(it->second.in, this);
+		std::erase(it->second.out, this);
+	}
+	std::erase(reactor.ready_, this);
+}
+
+void Reactor::make_ready(std::vector<FdAwaiter *> &list)
+{
+	ready_.insert(ready_.end(), list.begin(), list.end());
+	list.clear();
+}
+
+void Reactor::resume_ready()
+{
+	/* one at a time: a resumed coroutine may destroy others that are due */
+	while (!ready_.empty()) {
+		FdAwaiter *a = ready_.front();
+		ready_.pop_front();
+		std::exchange(a->handle, {}).resume();
+	}
+}
+
+void Reactor::wake(int fd)
+{
+	auto it = waiters_.find(fd);
+	if (it == waiters_.end())
+		return;
+	make_ready(it->second.in);
+	make_ready(it->second.out);
+}
+
+detail::Detached Reactor::run_detached(Task<> task)
+{
+	try {
+		co_await std::move(task);
+	} catch (...) {
+		if (!error_)
+			error_ = std::current_exception();
+		stopped_ = true;
+	}
+	active_--;
+}
+
+void Reactor::spawn(Task<> task)
+{
+	active_++;
+	run_detached(std::move(task));
+}
+
+void Reactor::stop()
+{
+	std::uint64_t one = 1;
+	stopped_ = true;
+	(void)!::write(efd_, &one, sizeof(one));
+}
+
+void Reactor::post(std::function<void()> fn)
+{
+	std::uint64_t one = 1;
+	{
+		std::lock_guard<std::mutex> guard(post_lock_);
+		posted_.push_back(std::move(fn));
+	}
+	(void)!::write(efd_, &one, sizeof(one));
+}
+
+void Reactor::run_posted()
+{
+	std::vector<std::function<void()>> posted;
+	std::uint64_t count;
+	(void)!::read(efd_, &count, sizeof(count));
+	{
+		std::lock_guard<std::mutex> guard(post_lock_);
+		posted.swap(posted_);
+	}
+	for (auto &fn : posted)
+		fn();
+}
+
+void Reactor::run()
+{
+	std::array<epoll_event, 64> events;
+	stopped_ = false;
+	while (!stopped_ && active_) {
+		int n = epoll_wait(epfd_, events.data(), int(events.size()), ready_.empty() ? -1 : 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw_errno("epoll_wait");
+		}
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			std::uint32_t ev = events[i].events;
+			if (fd == efd_) {
+				run_posted();
+				continue;
+			}
+			auto it = waiters_.find(fd);
+			if (it == waiters_.end())
+				continue;
+			/* resumed coroutines may park again, so take the lists first */
+			if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+				make_ready(it->second.in);
+			if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+				make_ready(it->second.out);
+		}
+		resume_ready();
+	}
+	if (error_)
+		std::rethrow_exception(std::exchange(error_, nullptr));
+}
+
+/* Device */
+
+Device::Device(Reactor &reactor, unsigned minor) : Device(reactor, "/dev/usbdrv" + std::to_string(minor)) {}
+
+Device::Device(Reactor &reactor, std::string path) : reactor_(reactor), path_(std::move(path))
+{
+	open_fd();
+}
+
+void Device::open_fd()
+{
+	std::uint32_t version;
+	fd_ = ::open(path_.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd_ < 0)
+		throw_errno(path_.c_str());
+	if (ioctl(fd_, USBDRV_IOC_GET_VERSION, &version) < 0 || version < USBDRV_ABI_VERSION) {
+		close(fd_);
+		throw std::system_error(ENOTSUP, std::generic_category(), path_ + ": driver too old");
+	}
+	try {
+		reactor_.add(fd_);
+	} catch (...) {
+		close(fd_);
+		throw;
+	}
+}
+
+Device::~Device()
+{
+	reactor_.remove(fd_);
+	close(fd_);
+}
+
+Task<std::size_t> Device::read(std::span<std::byte> buf)
+{
+	std::uint64_t start = now_ns();
+	for (;;) {
+		ssize_t n = ::read(fd_, buf.data(), buf.size());
+		if (n >= 0) {
+			metrics_.read.record(since(start));
+			co_return std::size_t(n);
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			throw_errno("read");
+		co_await reactor_.readable(fd_);
+	}
+}
+
+Task<std::size_t> Device::write(std::span<const std::byte> buf)
+{
+	std::uint64_t start = now_ns();
+	for (;;) {
+		ssize_t n = ::write(fd_, buf.data(), buf.size());
+		if (n >= 0) {
+			metrics_.write.record(since(start));
+			co_return std::size_t(n);
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			throw_errno("write");
+		co_await reactor_.writable(fd_);
+	}
+}
+
+usbdrv_params Device::params() const
+{
+	usbdrv_params params{};
+	if (ioctl(fd_, USBDRV_IOC_GET_PARAMS, &params) < 0)
+		throw_errno("USBDRV_IOC_GET_PARAMS");
+	return params;
+}
+
+void Device::set_params(const usbdrv_params &params)
+{
+	usbdrv_params p = params;
+	p.version = USBDRV_ABI_VERSION;
+	if (ioctl(fd_, USBDRV_IOC_SET_PARAMS, &p) < 0)
+		throw_errno("USBDRV_IOC_SET_PARAMS");
+}
+
+usbdrv_stats Device::stats() const
+{
+	usbdrv_stats stats{};
+	if (ioctl(fd_, USBDRV_IOC_GET_STATS, &stats) < 0)
+		throw_errno("USBDRV_IOC_GET_STATS");
+	return stats;
+}
+
+std::size_t Device::submit(std::span<const usbdrv_xfer> xfers)
+{
+	usbdrv_submit submit{};
+	if (xfers.empty())
+		return 0;
+	submit.xfers = reinterpret_cast<std::uintptr_t>(xfers.data());
+	submit.count = std::uint32_t(xfers.size());
+	if (ioctl(fd_, USBDRV_IOC_SUBMIT, &submit) < 0) {
+		/* queue full: nothing went, try again after some completions */
+		if (errno == EAGAIN)
+			return 0;
+		throw_errno("USBDRV_IOC_SUBMIT");
+	}
+	return submit.submitted;
+}
+
+std::size_t Device::reap(std::span<usbdrv_completion> out)
+{
+	usbdrv_reap reap{};
+	reap.completions = reinterpret_cast<std::uintptr_t>(out.data());
+	reap.max = std::uint32_t(out.size());
+	reap.min_complete = 1;
+	reap.timeout_ms = 0;
+	if (ioctl(fd_, USBDRV_IOC_REAP, &reap) < 0)
+		throw_errno("USBDRV_IOC_REAP");
+	return reap.count;
+}
+
+void Device::complete(std::span<const usbdrv_completion> comp)
+{
+	std::uint64_t now = now_ns();
+	for (std::size_t i = 0; i < comp.size(); ++i) {
+		auto *p = reinterpret_cast<detail::Pending *>(std::uintptr_t(comp[i].user_data));
+		p->result->status = comp[i].status;
+		p->result->length = comp[i].actual_length;
+		p->result->completed_ns = comp[i].timestamp_ns;
+		p->result->latency_ns = now - p->submitted_ns;
+		metrics_.xfer.record(p->result->latency_ns);
+		metrics_.delivery.record(now - std::min(now, std::uint64_t(comp[i].timestamp_ns)));
+		(*p->outstanding)--;
+	}
+	/*
+	 * some of these may belong to Batches parked in pump(), let them look;
+	 * the slots they freed may let a Batch waiting to submit go on
+	 */
+	reactor_.wake(fd_);
+}
+
+Task<> Device::pump()
+{
+	std::array<usbdrv_completion, 64> comp;
+	std::size_t n = reap(comp);
+	if (!n) {
+		co_await reactor_.readable(fd_);
+		co_return;
+	}
+	complete(std::span(comp).first(n));
+}
+
+void Device::drain(const std::size_t &outstanding) noexcept
+{
+	std::array<usbdrv_completion, 64> comp;
+	while (outstanding) {
+		usbdrv_reap reap{};
+		reap.completions = reinterpret_cast<std::uintptr_t>(comp.data());
+		reap.max = std::uint32_t(comp.size());
+		reap.min_complete = 1;
+		reap.timeout_ms = -1;
+		if (ioctl(fd_, USBDRV_IOC_REAP, &reap) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		complete(std::span(comp).first(reap.count));
+	}
+}
+
+/* Batch */
+
+void Batch::add_in(std::span<std::byte> buf, std::uint32_t flags)
+{
+	usbdrv_xfer x{};
+	x.buffer = reinterpret_cast<std::uintptr_t>(buf.data());
+	x.length = std::uint32_t(buf.size());
+	x.dir = USBDRV_XFER_IN;
+	x.flags = flags;
+	xfers_.push_back(x);
+}
+
+void Batch::add_out(std::span<const std::byte> buf, std::uint32_t flags)
+{
+	usbdrv_xfer x{};
+	x.buffer = reinterpret_cast<std::uintptr_t>(buf.data());
+	x.length = std::uint32_t(buf.size());
+	x.dir = USBDRV_XFER_OUT;
+	x.flags = flags;
+	xfers_.push_back(x);
+}
+
+Task<std::vector<XferResult>> Batch::run()
+{
+	std::vector<XferResult> results(xfers_.size());
+	std::vector<detail::Pending> pending(xfers_.size());
+	std::size_t outstanding = 0, next = 0;
+	/* reap what is still out before pending goes, should we never get to the end */
+	struct Drain {
+		Device &dev;
+		const std::size_t &outstanding;
+		~Drain() { dev.drain(outstanding); }
+	} drain{dev_, outstanding};
+	for (std::size_t i = 0; i < xfers_.size(); ++i) {
+		pending[i] = {&results[i], &outstanding, 0};
+		xfers_[i].user_data = reinterpret_cast<std::uintptr_t>(&pending[i]);
+	}
+	while (next < xfers_.size() || outstanding) {
+		std::size_t n = 0;
+		if (next < xfers_.size()) {
+			std::uint64_t now = now_ns();
+			for (std::size_t i = next; i < xfers_.size(); ++i)
+				pending[i].submitted_ns = now;
+			n = dev_.submit(std::span(xfers_).subspan(next));
+			outstanding += n;
+			next += n;
+		}
+		/* the queue is full of others' transfers: none of ours will complete to wake us */
+		if (!n && !outstanding) {
+			co_await dev_.reactor().writable(dev_.fd());
+			continue;
+		}
+		/* completions make room for the rest, or finish the batch */
+		co_await dev_.pump();
+	}
+	co_return results;
+}
+
+/* Consumer */
+
+Consumer::Chunk &Consumer::Chunk::operator=(Chunk &&other) noexcept
+{
+	if (this != &other) {
+		if (owner_)
+			owner_->give_back(buf_);
+		owner_ = std::exchange(other.owner_, nullptr);
+		buf_ = other.buf_;
+		len_ = other.len_;
+	}
+	return *this;
+}
+
+Consumer::Chunk::~Chunk()
+{
+	if (owner_)
+		owner_->give_back(buf_);
+}
+
+Consumer::Consumer(Device &dev, std::size_t buffer_size, unsigned nr_buffers)
+	: dev_(dev), buffer_size_((std::max<std::size_t>(buffer_size, 1) + page_size - 1) & ~(page_size - 1))
+{
+	usbdrv_params params{};
+	fd_ = ::open(dev_.path().c_str(), O_RDWR | O_CLOEXEC);
+	if (fd_ < 0)
+		throw_errno(dev_.path().c_str());
+	/* short read timeout so stop() is noticed promptly */
+	if (ioctl(fd_, USBDRV_IOC_GET_PARAMS, &params) == 0) {
+		params.read_timeout_ms = 100;
+		ioctl(fd_, USBDRV_IOC_SET_PARAMS, &params);
+	}
+	efd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd_ < 0) {
+		int err = errno;
+		close(fd_);
+		throw_errno("eventfd", err);
+	}
+	try {
+		dev_.reactor().add(efd_);
+	} catch (...) {
+		close(efd_);
+		close(fd_);
+		throw;
+	}
+	for (unsigned i = 0; i < std::max(nr_buffers, 1u); ++i) {
+		auto *buf = static_cast<std::byte *>(std::aligned_alloc(page_size, buffer_size_));
+		if (!buf) {
+			for (auto *b : buffers_)
+				std::free(b);
+			dev_.reactor().remove(efd_);
+			close(efd_);
+			close(fd_);
+			throw std::bad_alloc();
+		}
+		buffers_.push_back(buf);
+		free_.push_back(buf);
+	}
+	thread_ = std::thread(&Consumer::reader, this);
+}
+
+Consumer::~Consumer()
+{
+	stop();
+	dev_.reactor().remove(efd_);
+	close(efd_);
+	close(fd_);
+	for (auto *b : buffers_)
+		std::free(b);
+}
+
+/* no more buffers after those filled, for @error; wakes a waiting next() */
+void Consumer::finish(int error)
+{
+	std::uint64_t one = 1;
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		if (!end_error_)
+			end_error_ = error;
+	}
+	(void)!::write(efd_, &one, sizeof(one));
+}
+
+void Consumer::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		stopping_ = true;
+	}
+	free_cv_.notify_all();
+	if (thread_.joinable())
+		thread_.join();
+	finish(ECANCELED);
+}
+
+void Consumer::reader()
+{
+	std::uint64_t one = 1;
+	for (;;) {
+		std::byte *buf;
+		{
+			std::unique_lock<std::mutex> guard(lock_);
+			free_cv_.wait(guard, [this] { return stopping_ || !free_.empty(); });
+			if (stopping_)
+				return;
+			buf = free_.front();
+			free_.pop_front();
+		}
+		ssize_t n;
+		do {
+			n = ::read(fd_, buf, buffer_size_);
+		} while (n < 0 && (errno == EINTR || errno == ETIMEDOUT) && !stopping_.load());
+		int err = n < 0 ? errno : 0;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			if (stopping_ || err) {
+				free_.push_back(buf);
+				if (stopping_)
+					return;
+			} else {
+				filled_.push_back({buf, std::size_t(n)});
+			}
+		}
+		if (err) {
+			finish(err);
+			return;
+		}
+		(void)!::write(efd_, &one, sizeof(one));
+	}
+}
+
+void Consumer::give_back(std::byte *buf)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		free_.push_back(buf);
+	}
+	free_cv_.notify_one();
+}
+
+Task<Consumer::Chunk> Consumer::next()
+{
+	for (;;) {
+		std::uint64_t count;
+		/* take the signal before looking, so one sent after the look wakes us */
+		(void)!::read(efd_, &count, sizeof(count));
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			if (!filled_.empty()) {
+				Filled f = filled_.front();
+				filled_.pop_front();
+				co_return Chunk(this, f.buf, f.len);
+			}
+			if (end_error_)
+				throw_errno("read", end_error_);
+		}
+		/* parked on the Reactor, so a coroutine destroyed meanwhile is simply forgotten */
+		co_await dev_.reactor().readable(efd_);
+	}
+}
+
+} // namespace usbdrv
@@ -0,0 +1,433 @@
+/*
+ * usbdrv.hpp - asynchronous C++20 client for the usbdev driver (/dev/usbdrv%d)
+ *
+ * One Reactor (an epoll loop) drives any number of Devices.  I/O is written
+ * as coroutines returning Task<>:
+ *
+ *	usbdrv::Reactor reactor;
+ *	usbdrv::Device dev(reactor, 0);
+ *	reactor.spawn([&]() -> usbdrv::Task<> {
+ *		std::array<std::byte, 4096> buf;
+ *		std::size_t n = co_await dev.read(buf);
+ *		co_await dev.write(std::span(buf).first(n));
+ *	}());
+ *	reactor.run();
+ *
+ * Errors are thrown as std::system_error.  Everything but Consumer runs on
+ * the thread that calls Reactor::run().
+ */
+#ifndef USBDRV_HPP
+#define USBDRV_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "usbdrv_ioctl.h"
+
+namespace usbdrv {
+
+using Clock = std::chrono::steady_clock;	/* CLOCK_MONOTONIC, like the driver's timestamps */
+
+/* nanoseconds on the driver's clock */
+std::uint64_t now_ns();
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+struct FinalAwaiter {
+	bool await_ready() const noexcept { return false; }
+	template<typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+	{
+		auto next = h.promise().continuation;
+		return next ? next : std::noop_coroutine();
+	}
+	void await_resume() const noexcept {}
+};
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	FinalAwaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+/* fire-and-forget frame behind Reactor::spawn() */
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() const noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+/* one submitted transfer; user_data points at it */
+struct Pending;
+
+} // namespace detail
+
+/*
+ * Lazily started coroutine.  co_await runs it and yields its result, or
+ * rethrows what escaped it.
+ */
+template<typename T>
+class Task {
+public:
+	struct promise_type : detail::PromiseBase {
+		std::optional<T> value;
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		template<typename U>
+		void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+	};
+
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(other.h_, {});
+		}
+		return *this;
+	}
+	~Task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		h_.promise().continuation = caller;
+		return h_;
+	}
+	T await_resume()
+	{
+		auto &p = h_.promise();
+		if (p.error)
+			std::rethrow_exception(p.error);
+		return std::move(*p.value);
+	}
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+	std::coroutine_handle<promise_type> h_;
+};
+
+template<>
+class Task<void> {
+public:
+	struct promise_type : detail::PromiseBase {
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		void return_void() const noexcept {}
+	};
+
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(other.h_, {});
+		}
+		return *this;
+	}
+	~Task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		h_.promise().continuation = caller;
+		return h_;
+	}
+	void await_resume()
+	{
+		if (h_.promise().error)
+			std::rethrow_exception(h_.promise().error);
+	}
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+	std::coroutine_handle<promise_type> h_;
+};
+
+/*
+ * Latency histogram with power-of-two buckets: cheap enough to record every
+ * operation, percentiles are exact to within a factor of two.
+ */
+class Histogram {
+public:
+	void record(std::uint64_t ns);
+	void reset();
+	/* add the samples of @other, e.g. one histogram per thread */
+	void merge(const Histogram &other);
+
+	std::uint64_t count() const { return count_; }
+	std::uint64_t min() const { return count_ ? min_ : 0; }
+	std::uint64_t max() const { return max_; }
+	double mean() const { return count_ ? double(sum_) / double(count_) : 0.0; }
+	/* upper bound of the bucket holding the @p quantile (0..1) */
+	std::uint64_t percentile(double p) const;
+
+private:
+	std::array<std::uint64_t, 64> buckets_{};
+	std::uint64_t count_ = 0, sum_ = 0, min_ = ~std::uint64_t(0), max_ = 0;
+};
+
+/* client-side latencies of one Device, in nanoseconds */
+struct Metrics {
+	Histogram read;		/* read() call to data */
+	Histogram write;	/* write() call to queued */
+	Histogram xfer;		/* submit to reaped completion */
+	Histogram delivery;	/* driver completion timestamp to reaped */
+
+	void reset();
+};
+
+/*
+ * epoll loop.  Devices register their fd once; coroutines that would block
+ * park on the fd's readiness and are resumed from run().
+ */
+class Reactor {
+public:
+	Reactor();
+	~Reactor();
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+
+	/* start @task now; run() keeps going until every spawned task is done */
+	void spawn(Task<> task);
+	/* dispatch events until all tasks finished or stop(); rethrows the first exception a task let escape */
+	void run();
+	void stop();
+	/* run @fn on the loop thread; callable from any thread */
+	void post(std::function<void()> fn);
+
+	/*
+	 * Parks a coroutine until the fd is ready.  A coroutine destroyed while
+	 * parked takes itself off the Reactor's lists.
+	 */
+	struct FdAwaiter {
+		Reactor &reactor;
+		int fd;
+		bool out;
+		std::coroutine_handle<> handle = {};	/* set while parked */
+
+		~FdAwaiter();
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h);
+		void await_resume() const noexcept {}
+	};
+	FdAwaiter readable(int fd) { return {*this, fd, false}; }
+	FdAwaiter writable(int fd) { return {*this, fd, true}; }
+
+	void add(int fd);
+	void remove(int fd);
+	/* resume whoever waits on @fd, from the loop */
+	void wake(int fd);
+
+private:
+	struct Waiters {
+		std::vector<FdAwaiter *> in, out;
+	};
+
+	detail::Detached run_detached(Task<> task);
+	void run_posted();
+	void make_ready(std::vector<FdAwaiter *> &list);
+	void resume_ready();
+
+	int epfd_ = -1;
+	int efd_ = -1;			/* eventfd behind post() and stop() */
+	bool stopped_ = false;
+	std::size_t active_ = 0;	/* spawned tasks still running */
+	std::exception_ptr error_;
+	std::unordered_map<int, Waiters> waiters_;
+	std::deque<FdAwaiter *> ready_;		/* to be resumed by run() */
+	std::mutex post_lock_;
+	std::vector<std::function<void()>> posted_;
+};
+
+/* outcome of one transfer of a Batch, in the order they were added */
+struct XferResult {
+	int status = 0;			/* 0 or a negative errno */
+	std::uint32_t length = 0;	/* bytes transferred */
+	std::uint64_t completed_ns = 0;	/* driver completion time, see now_ns() */
+	std::uint64_t latency_ns = 0;	/* submit to reap */
+};
+
+/*
+ * An open /dev/usbdrv%d.  The fd is non-blocking; read() and write() wait
+ * on the Reactor instead.  Reads go through the driver's receive pool; for
+ * reads straight into user pages use a Consumer.
+ */
+class Device {
+public:
+	Device(Reactor &reactor, unsigned minor);
+	Device(Reactor &reactor, std::string path);
+	~Device();
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	int fd() const { return fd_; }
+	const std::string &path() const { return path_; }
+	Reactor &reactor() { return reactor_; }
+
+	Task<std::size_t> read(std::span<std::byte> buf);
+	Task<std::size_t> write(std::span<const std::byte> buf);
+
+	usbdrv_params params() const;
+	void set_params(const usbdrv_params &params);
+	usbdrv_stats stats() const;
+
+	/* start as many of @xfers as the fd's queue takes; returns how many */
+	std::size_t submit(std::span<const usbdrv_xfer> xfers);
+	/* collect ready completions without waiting */
+	std::size_t reap(std::span<usbdrv_completion> out);
+	/*
+	 * One round of completion handling for Batches: hand out what is ready,
+	 * or wait until something may be.  Callers loop until their own
+	 * transfers are in.
+	 */
+	Task<> pump();
+
+	Metrics &metrics() { return metrics_; }
+
+private:
+	friend class Batch;
+
+	void open_fd();
+	void complete(std::span<const usbdrv_completion> comp);
+	void drain(const std::size_t &outstanding) noexcept;
+
+	Reactor &reactor_;
+	std::string path_;
+	int fd_ = -1;
+	Metrics metrics_;
+};
+
+/*
+ * A set of bulk transfers submitted with as few USBDRV_IOC_SUBMIT calls as
+ * the fd's queue_depth allows and awaited together.  Several Batches may
+ * run on one Device at once.
+ */
+class Batch {
+public:
+	explicit Batch(Device &dev) : dev_(dev) {}
+
+	/*
+	 * Buffers must stay valid until run() completes.  A run() destroyed or
+	 * thrown out of half way blocks until the transfers it submitted are
+	 * reaped, since the driver copies IN data into them at that point.
+	 */
+	void add_in(std::span<std::byte> buf, std::uint32_t flags = 0);
+	void add_out(std::span<const std::byte> buf, std::uint32_t flags = 0);
+	std::size_t size() const { return xfers_.size(); }
+	void clear() { xfers_.clear(); }
+
+	Task<std::vector<XferResult>> run();
+
+private:
+	Device &dev_;
+	std::vector<usbdrv_xfer> xfers_;
+};
+
+/*
+ * Zero-copy consumer.  The driver has no mmap ring, but reads of
+ * direct_read_kb or more into page-aligned memory are DMA'd straight into
+ * the caller's pages.  A Consumer keeps a set of such buffers, fills them
+ * with blocking reads on a thread of its own (on a second fd, the direct
+ * path doesn't take O_NONBLOCK) and hands them to coroutines on the Reactor
+ * without copying.  A Chunk gives its buffer back when destroyed.  Create
+ * and destroy it on the Reactor's thread, once nobody awaits next().  Data
+ * only takes the direct path while nothing streams the device's receive
+ * pool, no receive filter or CRC check is set and the pool holds no data.
+ */
+class Consumer {
+public:
+	class Chunk {
+	public:
+		Chunk() = default;
+		Chunk(Chunk &&other) noexcept : owner_(std::exchange(other.owner_, nullptr)), buf_(other.buf_), len_(other.len_) {}
+		Chunk &operator=(Chunk &&other) noexcept;
+		~Chunk();
+
+		std::span<const std::byte> data() const { return {buf_, len_}; }
+		explicit operator bool() const { return owner_ != nullptr; }
+
+	private:
+		friend class Consumer;
+		Chunk(Consumer *owner, std::byte *buf, std::size_t len) : owner_(owner), buf_(buf), len_(len) {}
+
+		Consumer *owner_ = nullptr;
+		std::byte *buf_ = nullptr;
+		std::size_t len_ = 0;
+	};
+
+	/* @buffer_size is rounded up to whole pages */
+	Consumer(Device &dev, std::size_t buffer_size = 1 << 20, unsigned nr_buffers = 4);
+	~Consumer();
+	Consumer(const Consumer &) = delete;
+	Consumer &operator=(const Consumer &) = delete;
+
+	/*
+	 * The next filled buffer, oldest first; one caller at a time.  Once
+	 * they are used up it throws the read error the reader stopped on, or
+	 * ECANCELED after stop(), also to a next() already waiting.
+	 */
+	Task<Chunk> next();
+	void stop();
+
+private:
+	struct Filled {
+		std::byte *buf;
+		std::size_t len;
+	};
+
+	void reader();
+	void give_back(std::byte *buf);
+	void finish(int error);
+
+	Device &dev_;
+	std::size_t buffer_size_;
+	int fd_ = -1;
+	std::vector<std::byte *> buffers_;
+	std::mutex lock_;
+	std::condition_variable free_cv_;
+	std::deque<std::byte *> free_;		/* under lock_ */
+	std::deque<Filled> filled_;		/* under lock_ */
+	int end_error_ = 0;			/* under lock_, why no more buffers come */
+	int efd_ = -1;				/* eventfd on the Reactor, reader() signals next() through it */
+	std::atomic<bool> stopping_ = false;	/* set under lock_, read without it by reader() */
+	std::thread thread_;
+};
+
+} // namespace usbdrv
+
+#endif /* USBDRV_HPP */
@@ -0,0 +1,411 @@
+/*
+ * libusbdrv_test - unit tests of the client library that need no device
+ *
+ * Covers Histogram, Task, the Reactor and the Consumer: results and
+ * exceptions through co_await, post() from another thread, wake(),
+ * coroutines destroyed while parked, and how a waiting next() ends.  Pipes
+ * and FIFOs stand in for the device fd.  Run by
+ * "make check", built with the sanitizers so a dangling coroutine handle
+ * shows up as an error instead of luck.
+ */
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "usbdrv.hpp"
+
+namespace {
+
+int failures;
+bool consumer_nonblock;		/* make the Consumer's reads fail with EAGAIN */
+
+} // namespace
+
+/*
+ * A FIFO stands in for /dev/usbdrv%d in the Consumer tests: answer the
+ * driver ioctls made on the way, pass everything else to the kernel.
+ */
+extern "C" int ioctl(int fd, unsigned long request, ...) noexcept
+{
+	va_list ap;
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode))
+		return int(syscall(SYS_ioctl, fd, request, arg));
+	switch (request) {
+	case USBDRV_IOC_GET_VERSION:
+		*static_cast<std::uint32_t *>(arg) = USBDRV_ABI_VERSION;
+		return 0;
+	case USBDRV_IOC_GET_PARAMS:
+		*static_cast<usbdrv_params *>(arg) = usbdrv_params{};
+		return 0;
+	case USBDRV_IOC_SET_PARAMS:
+		/* only the Consumer's own fd is set up, and a non-blocking read fails */
+		if (consumer_nonblock)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		return 0;
+	}
+	errno = ENOTTY;
+	return -1;
+}
+
+namespace {
+
+#define CHECK(cond)                                                                      \
+	do {                                                                             \
+		if (!(cond)) {                                                           \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			failures++;                                                      \
+		}                                                                        \
+	} while (0)
+
+/* a non-blocking pipe, both ends closed on destruction */
+struct Pipe {
+	int rd = -1, wr = -1;
+
+	Pipe()
+	{
+		int fds[2];
+		if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+			throw std::runtime_error("pipe2");
+		rd = fds[0];
+		wr = fds[1];
+	}
+	~Pipe()
+	{
+		close(rd);
+		close(wr);
+	}
+	void put() { (void)!::write(wr, "x", 1); }
+};
+
+/* a FIFO in a directory of its own, both removed on destruction */
+struct Fifo {
+	std::string dir, path;
+
+	Fifo()
+	{
+		char tmpl[] = "/tmp/libusbdrv_test.XXXXXX";
+		if (!mkdtemp(tmpl))
+			throw std::runtime_error("mkdtemp");
+		dir = tmpl;
+		path = dir + "/dev";
+		if (mkfifo(path.c_str(), 0600) < 0)
+			throw std::runtime_error("mkfifo");
+	}
+	~Fifo()
+	{
+		unlink(path.c_str());
+		rmdir(dir.c_str());
+	}
+	void put()
+	{
+		int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+		(void)!::write(fd, "x", 1);
+		close(fd);
+	}
+};
+
+/*
+ * Starts a task right away and keeps its frame until destroy(), so a test
+ * can throw a coroutine away while it is parked.
+ */
+struct Holder {
+	struct promise_type {
+		Holder get_return_object() { return Holder{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_always final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+	std::coroutine_handle<promise_type> h;
+
+	void destroy() { h.destroy(); }
+};
+
+Holder hold(usbdrv::Task<> task)
+{
+	co_await std::move(task);
+}
+
+void test_histogram()
+{
+	usbdrv::Histogram h;
+	CHECK(h.count() == 0 && h.min() == 0 && h.max() == 0 && h.percentile(0.5) == 0);
+	for (std::uint64_t i = 1; i <= 1000; ++i)
+		h.record(i);
+	CHECK(h.count() == 1000);
+	CHECK(h.min() == 1 && h.max() == 1000);
+	CHECK(h.mean() == 500.5);
+	/* exact to within the factor of two of a bucket */
+	CHECK(h.percentile(0.5) >= 500 && h.percentile(0.5) < 1000);
+	CHECK(h.percentile(1.0) == 1000);
+	CHECK(h.percentile(0.0) >= 1);
+
+	usbdrv::Histogram other;
+	other.record(0);
+	other.record(5000);
+	h.merge(other);
+	CHECK(h.count() == 1002);
+	CHECK(h.min() == 0 && h.max() == 5000);
+
+	usbdrv::Histogram empty;
+	h.merge(empty);
+	CHECK(h.count() == 1002 && h.min() == 0);
+	h.reset();
+	CHECK(h.count() == 0 && h.max() == 0);
+}
+
+usbdrv::Task<int> answer()
+{
+	co_return 42;
+}
+
+usbdrv::Task<> fail()
+{
+	throw std::runtime_error("fail");
+	co_return;
+}
+
+void test_task()
+{
+	usbdrv::Reactor reactor;
+	int value = 0;
+	bool caught = false;
+	auto task = [&]() -> usbdrv::Task<> {
+		value = co_await answer();
+		try {
+			co_await fail();
+		} catch (const std::runtime_error &) {
+			caught = true;
+		}
+	};
+	reactor.spawn(task());
+	reactor.run();
+	CHECK(value == 42);
+	CHECK(caught);
+}
+
+void test_run_rethrows()
+{
+	usbdrv::Reactor reactor;
+	bool thrown = false;
+	reactor.spawn(fail());
+	try {
+		reactor.run();
+	} catch (const std::runtime_error &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+}
+
+void test_post_from_thread()
+{
+	usbdrv::Reactor reactor;
+	Pipe p;
+	bool posted = false, woke = false;
+	reactor.add(p.rd);
+	auto reader = [&]() -> usbdrv::Task<> {
+		co_await reactor.readable(p.rd);
+		woke = true;
+	};
+	reactor.spawn(reader());
+	std::thread t([&] {
+		reactor.post([&] {
+			posted = true;
+			p.put();
+		});
+	});
+	reactor.run();
+	t.join();
+	reactor.remove(p.rd);
+	CHECK(posted);
+	CHECK(woke);
+}
+
+void test_wake()
+{
+	usbdrv::Reactor reactor;
+	Pipe p;
+	int order = 0, parked = 0, waking = 0;
+	reactor.add(p.rd);
+	/* nothing ever arrives on the pipe: only wake() resumes it */
+	auto sleeper = [&]() -> usbdrv::Task<> {
+		co_await reactor.readable(p.rd);
+		parked = ++order;
+	};
+	reactor.spawn(sleeper());
+	auto waker = [&]() -> usbdrv::Task<> {
+		reactor.wake(p.rd);
+		waking = ++order;
+		co_return;
+	};
+	reactor.spawn(waker());
+	reactor.run();
+	reactor.remove(p.rd);
+	/* wake() defers to the loop rather than resuming inline */
+	CHECK(waking == 1);
+	CHECK(parked == 2);
+}
+
+void test_writable()
+{
+	usbdrv::Reactor reactor;
+	Pipe p;
+	bool done = false;
+	reactor.add(p.wr);
+	auto writer = [&]() -> usbdrv::Task<> {
+		co_await reactor.writable(p.wr);
+		done = true;
+	};
+	reactor.spawn(writer());
+	reactor.run();
+	reactor.remove(p.wr);
+	CHECK(done);
+}
+
+void test_destroyed_waiter()
+{
+	usbdrv::Reactor reactor;
+	Pipe p;
+	bool gone_resumed = false, other = false;
+	reactor.add(p.rd);
+	auto doomed = [&]() -> usbdrv::Task<> {
+		co_await reactor.readable(p.rd);
+		gone_resumed = true;
+	};
+	Holder h = hold(doomed());
+	/* parked on p.rd; destroying it must take it off the Reactor's lists */
+	h.destroy();
+	auto survivor = [&]() -> usbdrv::Task<> {
+		co_await reactor.readable(p.rd);
+		other = true;
+	};
+	reactor.spawn(survivor());
+	p.put();
+	reactor.run();
+	CHECK(other);
+	CHECK(!gone_resumed);
+
+	/* the same once it was already due to be resumed */
+	auto doomed_due = [&]() -> usbdrv::Task<> {
+		co_await reactor.readable(p.rd);
+		gone_resumed = true;
+	};
+	Holder h2 = hold(doomed_due());
+	auto killer = [&]() -> usbdrv::Task<> {
+		reactor.wake(p.rd);
+		h2.destroy();
+		/* keep the loop going through a round of the ready list */
+		p.put();
+		co_await reactor.readable(p.rd);
+	};
+	reactor.spawn(killer());
+	reactor.run();
+	reactor.remove(p.rd);
+	CHECK(!gone_resumed);
+}
+
+/* stop() ends a next() that is waiting, and forgets one destroyed while it waited */
+void test_consumer_stop()
+{
+	Fifo fifo;
+	usbdrv::Reactor reactor;
+	usbdrv::Device dev(reactor, fifo.path);
+	usbdrv::Consumer consumer(dev, 4096, 2);
+	bool gone_resumed = false;
+	int err = 0;
+	auto doomed = [&]() -> usbdrv::Task<> {
+		co_await consumer.next();
+		gone_resumed = true;
+	};
+	Holder h = hold(doomed());
+	h.destroy();
+	auto waiter = [&]() -> usbdrv::Task<> {
+		try {
+			co_await consumer.next();
+		} catch (const std::system_error &e) {
+			err = e.code().value();
+		}
+	};
+	reactor.spawn(waiter());
+	auto stopper = [&]() -> usbdrv::Task<> {
+		/* the reader sits in read(); data arriving once it is told to stop lets it go */
+		std::thread t([&] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			fifo.put();
+		});
+		consumer.stop();
+		t.join();
+		co_return;
+	};
+	reactor.spawn(stopper());
+	reactor.run();
+	CHECK(err == ECANCELED);
+	CHECK(!gone_resumed);
+}
+
+/* after a read error every next(), waiting or later, gets the error */
+void test_consumer_error()
+{
+	Fifo fifo;
+	usbdrv::Reactor reactor;
+	usbdrv::Device dev(reactor, fifo.path);
+	consumer_nonblock = true;
+	usbdrv::Consumer consumer(dev, 4096, 2);
+	consumer_nonblock = false;
+	int err[2] = {};
+	auto consume = [&]() -> usbdrv::Task<> {
+		for (int &e : err) {
+			try {
+				co_await consumer.next();
+			} catch (const std::system_error &x) {
+				e = x.code().value();
+			}
+		}
+	};
+	reactor.spawn(consume());
+	reactor.run();
+	CHECK(err[0] == EAGAIN);
+	CHECK(err[1] == EAGAIN);
+}
+
+} // namespace
+
+int main()
+{
+	struct {
+		const char *name;
+		void (*fn)();
+	} tests[] = {
+		{"histogram", test_histogram},
+		{"task", test_task},
+		{"run_rethrows", test_run_rethrows},
+		{"post_from_thread", test_post_from_thread},
+		{"wake", test_wake},
+		{"writable", test_writable},
+		{"destroyed_waiter", test_destroyed_waiter},
+		{"consumer_stop", test_consumer_stop},
+		{"consumer_error", test_consumer_error},
+	};
+	for (auto &t : tests) {
+		int before = failures;
+		t.fn();
+		std::printf("%-20s %s\n", t.name, failures == before ? "ok" : "FAILED");
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# run_dummy_hcd.sh - run usbdrv_ioctl_test against an emulated device
+#
+# Loads dummy_hcd (a software host and device controller pair) and g_zero
+# (a test gadget, 1a0a:badd) on top of it, binds usbdev to the gadget and
+# runs the ioctl cases: first with g_zero's source/sink configuration, then
+# reloaded with its loopback one.  Needs root, a kernel with
+# CONFIG_USB_DUMMY_HCD and CONFIG_USB_ZERO as modules, and usbdev.ko built
+# in the top directory.  Modules the script loaded are unloaded on exit.
+#
+#	sudo tests/run_dummy_hcd.sh
+#
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+top=$(dirname "$here")
+drv=/sys/bus/usb/drivers/usbdev
+vid=1a0a
+pid=badd
+loaded=""
+
+cleanup() {
+	for m in $loaded; do
+		rmmod "$m" 2>/dev/null || true
+	done
+}
+trap cleanup EXIT
+
+load() {
+	name=$1
+	shift
+	if ! grep -q "^$name " /proc/modules; then
+		modprobe "$name" "$@"
+		loaded="$name $loaded"
+	fi
+}
+
+# (re)load g_zero with the given parameters
+gadget() {
+	if grep -q "^g_zero " /proc/modules; then
+		rmmod g_zero
+	fi
+	modprobe g_zero "$@"
+	case " $loaded " in
+	*" g_zero "*) ;;
+	*) loaded="g_zero $loaded" ;;
+	esac
+}
+
+# the g_zero device's usb directory, once enumerated
+gadget_dev() {
+	for d in /sys/bus/usb/devices/*; do
+		if [ -f "$d/idVendor" ] && [ "$(cat "$d/idVendor")" = $vid ] && [ "$(cat "$d/idProduct")" = $pid ]; then
+			echo "$d"
+			return 0
+		fi
+	done
+	return 1
+}
+
+# bind every interface of the gadget to usbdev, taking it from usbtest & co.
+bind_usbdev() {
+	dev=$1
+	for intf in "$dev"/"$(basename "$dev")":*; do
+		[ -d "$intf" ] || continue
+		name=$(basename "$intf")
+		if [ -e "$intf/driver" ]; then
+			[ "$(basename "$(readlink "$intf/driver")")" = usbdev ] && continue
+			echo "$name" > "$intf/driver/unbind"
+		fi
+		echo "$name" > $drv/bind 2>/dev/null || true
+	done
+}
+
+# wait for the gadget's /dev/usbdrv%d; sets node and minor
+find_node() {
+	i=0
+	while [ $i -lt 50 ]; do
+		if dev=$(gadget_dev); then
+			bind_usbdev "$dev"
+			for m in "$dev"/"$(basename "$dev")":*/usbmisc/usbdrv*; do
+				if [ -e "$m" ]; then
+					node=/dev/$(basename "$m")
+					minor=$(cut -d: -f2 < "$m/dev")
+					[ -c "$node" ] && return 0
+				fi
+			done
+		fi
+		sleep 0.1
+		i=$((i + 1))
+	done
+	echo "no usbdrv node for $vid:$pid" >&2
+	return 1
+}
+
+run_cases() {
+	config=$1
+	for c in $("$here/usbdrv_ioctl_test" -l "$config"); do
+		if ! "$here/usbdrv_ioctl_test" -d "$node" -m "$minor" "$c"; then
+			failed="$failed $c"
+		fi
+	done
+}
+
+make -C "$here" usbdrv_ioctl_test
+
+load dummy_hcd
+if ! grep -q "^usbdev " /proc/modules; then
+	insmod "$top/usbdev.ko"
+	loaded="usbdev $loaded"
+fi
+echo "$vid $pid" > $drv/new_id 2>/dev/null || true
+
+failed=""
+# pattern=1: bulk-in data counts i % 63 through every 512 bytes
+gadget pattern=1
+find_node
+run_cases sourcesink
+
+gadget loopdefault=1
+find_node
+run_cases loopback
+
+if [ -n "$failed" ]; then
+	echo "failed:$failed" >&2
+	exit 1
+fi
+echo "all cases passed"
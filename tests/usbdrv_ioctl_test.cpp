@@ -0,0 +1,1057 @@
+/*
+ * usbdrv_ioctl_test - the driver's ioctls against a real or emulated device
+ *
+ * Each case exercises one feature on a fresh fd of /dev/usbdrv%d, checking
+ * both what it does and the errors for bad arguments.  Written for g_zero
+ * on dummy_hcd, see run_dummy_hcd.sh: the cases expect its source/sink
+ * configuration (bulk-in produces data, bulk-out swallows it) unless the
+ * table says loopback (bulk-out comes back on bulk-in).
+ *
+ *	usbdrv_ioctl_test -d /dev/usbdrv0 -m minor case...
+ *	usbdrv_ioctl_test -l [sourcesink|loopback]
+ */
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "usbdrv_ioctl.h"
+
+namespace {
+
+int failures;
+
+#define CHECK(cond)                                                                      \
+	do {                                                                             \
+		if (!(cond)) {                                                           \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed (errno %s)\n", __FILE__, __LINE__, #cond, \
+				     std::strerror(errno));                              \
+			failures++;                                                      \
+		}                                                                        \
+	} while (0)
+
+/* @expr fails with @err */
+#define CHECK_ERR(expr, err) CHECK((expr) < 0 && errno == (err))
+
+struct Ctx {
+	std::string path;
+	unsigned minor;
+	int fd;
+};
+
+usbdrv_params get_params(int fd)
+{
+	usbdrv_params p{};
+	CHECK(ioctl(fd, USBDRV_IOC_GET_PARAMS, &p) == 0);
+	return p;
+}
+
+int set_params(int fd, usbdrv_params p)
+{
+	p.version = USBDRV_ABI_VERSION;
+	return ioctl(fd, USBDRV_IOC_SET_PARAMS, &p);
+}
+
+std::uint64_t counter(int fd, int idx)
+{
+	usbdrv_stats s{};
+	CHECK(ioctl(fd, USBDRV_IOC_GET_STATS, &s) == 0);
+	return s.counter[idx];
+}
+
+/* @attr of our interface in sysfs, found through the class device; "" for the interface itself */
+std::string intf_attr(const Ctx &c, const std::string &attr)
+{
+	std::string name = c.path.substr(c.path.rfind('/') + 1);
+	return "/sys/class/usbmisc/" + name + "/device" + (attr.empty() ? "" : "/" + attr);
+}
+
+/* the interface's name, as the driver's bind and unbind files take it */
+std::string intf_name(const Ctx &c)
+{
+	char link[PATH_MAX];
+	ssize_t n = readlink(intf_attr(c, "").c_str(), link, sizeof(link) - 1);
+	if (n <= 0)
+		return "";
+	link[n] = 0;
+	const char *slash = std::strrchr(link, '/');
+	return slash ? slash + 1 : link;
+}
+
+/* the USB device's power/@attr */
+std::string power_attr(const Ctx &c, const char *attr)
+{
+	return intf_attr(c, std::string("../power/") + attr);
+}
+
+std::string read_attr(const std::string &path)
+{
+	char buf[64];
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return "";
+	ssize_t n = read(fd, buf, sizeof(buf));
+	close(fd);
+	std::string s(buf, n > 0 ? size_t(n) : 0);
+	while (!s.empty() && s.back() == '\n')
+		s.pop_back();
+	return s;
+}
+
+bool write_attr(const std::string &path, const std::string &value)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	bool ok = write(fd, value.data(), value.size()) == ssize_t(value.size());
+	close(fd);
+	return ok;
+}
+
+void test_params(Ctx &c)
+{
+	std::uint32_t version = 0;
+	CHECK(ioctl(c.fd, USBDRV_IOC_GET_VERSION, &version) == 0 && version == USBDRV_ABI_VERSION);
+
+	usbdrv_params p = get_params(c.fd);
+	CHECK(p.version == USBDRV_ABI_VERSION);
+	CHECK(p.transfer_size && p.transfer_size <= USBDRV_MAX_TRANSFER && p.queue_depth);
+
+	/* a synchronous write reports the transfer's own result */
+	usbdrv_params sync = p;
+	sync.io_mode = USBDRV_IO_SYNC;
+	sync.short_policy = USBDRV_SHORT_ZLP;
+	sync.write_timeout_ms = 1000;
+	CHECK(set_params(c.fd, sync) == 0);
+	CHECK(get_params(c.fd).io_mode == USBDRV_IO_SYNC);
+	std::vector<char> buf(1024);
+	CHECK(write(c.fd, buf.data(), buf.size()) == ssize_t(buf.size()));
+
+	usbdrv_params bad = p;
+	bad.version = 0;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_SET_PARAMS, &bad), EINVAL);
+	bad.version = USBDRV_ABI_VERSION + 1;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_SET_PARAMS, &bad), EINVAL);
+	bad = p;
+	bad.reserved[0] = 1;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad = p;
+	bad.transfer_size = 0;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad.transfer_size = USBDRV_MAX_TRANSFER + 1;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad = p;
+	bad.queue_depth = 0;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad = p;
+	bad.short_policy = 0x80;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad = p;
+	bad.io_mode = USBDRV_NR_IO_MODES;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad = p;
+	bad.prio = USBDRV_NR_PRIO;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	bad = p;
+	bad.crc_flags = 0x80;
+	CHECK_ERR(set_params(c.fd, bad), EINVAL);
+	/* a failed set leaves the old parameters */
+	CHECK(get_params(c.fd).io_mode == USBDRV_IO_SYNC);
+}
+
+/* g_zero with pattern=1 fills every 512 byte packet with 0, 1 .. 62, 0, 1 .. */
+bool gzero_pattern(const unsigned char *p, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		if (p[i] != (i % 512) % 63)
+			return false;
+	return true;
+}
+
+usbdrv_xfer make_xfer(void *buf, std::uint32_t len, std::uint32_t dir, std::uint64_t user_data)
+{
+	usbdrv_xfer x{};
+	x.user_data = user_data;
+	x.buffer = reinterpret_cast<std::uintptr_t>(buf);
+	x.length = len;
+	x.dir = dir;
+	return x;
+}
+
+/* submit @xfers, returns the number started or -1 */
+int submit(int fd, std::vector<usbdrv_xfer> &xfers)
+{
+	usbdrv_submit s{};
+	s.xfers = reinterpret_cast<std::uintptr_t>(xfers.data());
+	s.count = std::uint32_t(xfers.size());
+	if (ioctl(fd, USBDRV_IOC_SUBMIT, &s) < 0)
+		return -1;
+	return int(s.submitted);
+}
+
+/* reap until @want completions came in or it times out, returns them */
+std::vector<usbdrv_completion> reap(int fd, std::uint32_t want)
+{
+	std::vector<usbdrv_completion> comp(want);
+	std::uint32_t got = 0;
+	while (got < want) {
+		usbdrv_reap r{};
+		r.completions = reinterpret_cast<std::uintptr_t>(comp.data() + got);
+		r.max = want - got;
+		r.min_complete = want - got;
+		r.timeout_ms = 2000;
+		if (ioctl(fd, USBDRV_IOC_REAP, &r) < 0 || !r.count)
+			break;
+		got += r.count;
+	}
+	comp.resize(got);
+	return comp;
+}
+
+void test_submit(Ctx &c)
+{
+	std::vector<unsigned char> in[2], out(4096);
+	for (auto &b : in)
+		b.assign(4096, 0xff);
+	std::vector<usbdrv_xfer> xfers = {
+		make_xfer(in[0].data(), 4096, USBDRV_XFER_IN, 0),
+		make_xfer(out.data(), 4096, USBDRV_XFER_OUT, 1),
+		make_xfer(in[1].data(), 4096, USBDRV_XFER_IN, 2),
+		make_xfer(out.data(), 4096, USBDRV_XFER_OUT, 3),
+	};
+	CHECK(submit(c.fd, xfers) == 4);
+	auto comp = reap(c.fd, 4);
+	CHECK(comp.size() == 4);
+	unsigned seen = 0;
+	for (auto &k : comp) {
+		CHECK(k.user_data < 4 && k.status == 0 && k.actual_length == 4096 && k.timestamp_ns);
+		if (k.user_data < 4)
+			seen |= 1u << k.user_data;
+		if (k.user_data == 0 || k.user_data == 2)
+			CHECK(gzero_pattern(in[k.user_data / 2].data(), k.actual_length));
+	}
+	CHECK(seen == 0xf);
+
+	/* nothing outstanding: a non-blocking reap returns no completions */
+	usbdrv_completion none;
+	usbdrv_reap r{};
+	r.completions = reinterpret_cast<std::uintptr_t>(&none);
+	r.max = 1;
+	CHECK(ioctl(c.fd, USBDRV_IOC_REAP, &r) == 0 && r.count == 0);
+	r.max = 0;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_REAP, &r), EINVAL);
+
+	/* a bad transfer fails the batch when it is the first, ends it otherwise */
+	std::vector<usbdrv_xfer> bad = {make_xfer(in[0].data(), 0, USBDRV_XFER_IN, 0)};
+	CHECK_ERR(submit(c.fd, bad), EINVAL);
+	bad[0] = make_xfer(in[0].data(), USBDRV_MAX_TRANSFER + 1, USBDRV_XFER_IN, 0);
+	CHECK_ERR(submit(c.fd, bad), EINVAL);
+	bad[0] = make_xfer(in[0].data(), 4096, 2, 0);
+	CHECK_ERR(submit(c.fd, bad), EINVAL);
+
+	/* completions that can't be stored stay queued: the second slot is unmapped */
+	long page = sysconf(_SC_PAGESIZE);
+	void *mem = mmap(nullptr, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(mem != MAP_FAILED);
+	if (mem != MAP_FAILED) {
+		char *edge = static_cast<char *>(mem) + page;
+		CHECK(mprotect(edge, page, PROT_NONE) == 0);
+		std::vector<usbdrv_xfer> outs = {
+			make_xfer(out.data(), 512, USBDRV_XFER_OUT, 10),
+			make_xfer(out.data(), 512, USBDRV_XFER_OUT, 11),
+			make_xfer(out.data(), 512, USBDRV_XFER_OUT, 12),
+		};
+		CHECK(submit(c.fd, outs) == 3);
+		usbdrv_reap f{};
+		f.completions = reinterpret_cast<std::uintptr_t>(edge - sizeof(usbdrv_completion));
+		f.max = 3;
+		f.min_complete = 3;
+		f.timeout_ms = 2000;
+		CHECK(ioctl(c.fd, USBDRV_IOC_REAP, &f) == 0 && f.count == 1);
+		f.completions = reinterpret_cast<std::uintptr_t>(edge);
+		f.min_complete = 1;
+		f.timeout_ms = 0;
+		CHECK_ERR(ioctl(c.fd, USBDRV_IOC_REAP, &f), EFAULT);
+		comp = reap(c.fd, 2);
+		CHECK(comp.size() == 2);
+		if (comp.size() == 2)
+			CHECK(comp[0].user_data == 11 && comp[1].user_data == 12);
+		munmap(mem, 2 * page);
+	}
+
+	/* queue_depth bounds what one fd has outstanding */
+	usbdrv_params p = get_params(c.fd);
+	p.queue_depth = 2;
+	CHECK(set_params(c.fd, p) == 0);
+	std::vector<usbdrv_xfer> three = {
+		make_xfer(in[0].data(), 4096, USBDRV_XFER_IN, 0),
+		make_xfer(in[1].data(), 4096, USBDRV_XFER_IN, 1),
+		make_xfer(out.data(), 4096, USBDRV_XFER_OUT, 2),
+	};
+	CHECK(submit(c.fd, three) == 2);
+	CHECK(reap(c.fd, 2).size() == 2);
+}
+
+void test_direct(Ctx &c)
+{
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 2000;
+	CHECK(set_params(c.fd, p) == 0);
+
+	/* page aligned and at least direct_read_kb (64 by default) */
+	const size_t len = 64 * 1024;
+	auto *buf = static_cast<unsigned char *>(std::aligned_alloc(4096, len));
+	std::uint64_t direct = counter(c.fd, USBDRV_STAT_DIRECT_READS);
+	CHECK(read(c.fd, buf, len) == ssize_t(len));
+	CHECK(gzero_pattern(buf, len));
+	CHECK(counter(c.fd, USBDRV_STAT_DIRECT_READS) == direct + 1);
+	CHECK(counter(c.fd, USBDRV_STAT_DIRECT_READ_BYTES) >= len);
+	std::free(buf);
+}
+
+void test_read(Ctx &c)
+{
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 2000;
+	CHECK(set_params(c.fd, p) == 0);
+
+	/* below a packet: the pool still receives a whole one and keeps the rest */
+	unsigned char buf[20];
+	std::uint64_t rx = counter(c.fd, USBDRV_STAT_RX_TRANSFERS);
+	CHECK(read(c.fd, buf, 10) == 10);
+	CHECK(gzero_pattern(buf, 10));
+	CHECK(counter(c.fd, USBDRV_STAT_RX_TRANSFERS) == rx + 1);
+	usbdrv_rx_record rec{};
+	CHECK(ioctl(c.fd, USBDRV_IOC_RX_RECORD, &rec) == 0);
+	CHECK(rec.length >= 512 && rec.offset == 10);
+	CHECK(read(c.fd, buf + 10, 10) == 10);
+	CHECK(gzero_pattern(buf, 20));
+	CHECK(counter(c.fd, USBDRV_STAT_RX_TRANSFERS) == rx + 1);
+
+	/* reads below direct_read_kb come through the pool */
+	std::vector<unsigned char> big(8192);
+	std::uint64_t direct = counter(c.fd, USBDRV_STAT_DIRECT_READS);
+	ssize_t n = read(c.fd, big.data(), big.size());
+	CHECK(n > 0);
+	CHECK(counter(c.fd, USBDRV_STAT_DIRECT_READS) == direct);
+}
+
+/* the device as the only member of /dev/usbdrv_stripe */
+void test_stripe(Ctx &c)
+{
+	int st = open("/dev/usbdrv_stripe", O_RDWR | O_CLOEXEC);
+	CHECK(st >= 0);
+	if (st < 0)
+		return;
+	std::uint32_t val = 0;
+	CHECK_ERR(ioctl(st, USBDRV_IOC_STRIPE_SET_CHUNK, &val), EINVAL);
+	val = 4096;
+	CHECK(ioctl(st, USBDRV_IOC_STRIPE_SET_CHUNK, &val) == 0);
+	val = c.minor;
+	CHECK(ioctl(st, USBDRV_IOC_STRIPE_ADD, &val) == 0);
+	CHECK_ERR(ioctl(st, USBDRV_IOC_STRIPE_ADD, &val), EEXIST);
+	/* no usbdrv device has minor 0 */
+	val = 0;
+	CHECK_ERR(ioctl(st, USBDRV_IOC_STRIPE_ADD, &val), ENODEV);
+
+	usbdrv_stripe_info info{};
+	CHECK(ioctl(st, USBDRV_IOC_STRIPE_INFO, &info) == 0);
+	CHECK(info.chunk_size == 4096 && info.nr_members == 1 && info.minor[0] == c.minor && !info.gone);
+
+	std::vector<unsigned char> buf(8192);
+	CHECK(write(st, buf.data(), buf.size()) == ssize_t(buf.size()));
+	/* the member streams, so a read returns what its pool holds so far */
+	ssize_t n = read(st, buf.data(), buf.size());
+	CHECK(n > 0);
+	if (n > 0)
+		CHECK(gzero_pattern(buf.data(), size_t(n)));
+	CHECK(ioctl(st, USBDRV_IOC_STRIPE_INFO, &info) == 0);
+	CHECK(info.write_bytes >= 8192 && info.read_bytes >= std::uint64_t(n > 0 ? n : 1));
+
+	val = c.minor;
+	CHECK(ioctl(st, USBDRV_IOC_STRIPE_DEL, &val) == 0);
+	CHECK_ERR(ioctl(st, USBDRV_IOC_STRIPE_DEL, &val), ENOENT);
+	CHECK(ioctl(st, USBDRV_IOC_STRIPE_INFO, &info) == 0 && info.nr_members == 0);
+	close(st);
+}
+
+/* bridged to itself: what the source side produces goes into the sink */
+void test_bridge(Ctx &c)
+{
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_BRIDGE_STOP), EINVAL);
+	usbdrv_bridge br{};
+	br.minor = c.minor;
+	br.flags = 0x80;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_BRIDGE, &br), EINVAL);
+	br.flags = 0;
+	br.minor = 0;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_BRIDGE, &br), ENODEV);
+
+	std::uint64_t xfers = counter(c.fd, USBDRV_STAT_BRIDGE_XFERS);
+	std::uint64_t bytes = counter(c.fd, USBDRV_STAT_BRIDGE_BYTES);
+	std::uint64_t errors = counter(c.fd, USBDRV_STAT_BRIDGE_ERRORS);
+	br.minor = c.minor;
+	CHECK(ioctl(c.fd, USBDRV_IOC_BRIDGE, &br) == 0);
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_BRIDGE, &br), EBUSY);
+	char buf[512];
+	CHECK_ERR(read(c.fd, buf, sizeof(buf)), EBUSY);
+	usleep(200 * 1000);
+	CHECK(ioctl(c.fd, USBDRV_IOC_BRIDGE_STOP) == 0);
+	CHECK(counter(c.fd, USBDRV_STAT_BRIDGE_XFERS) > xfers);
+	CHECK(counter(c.fd, USBDRV_STAT_BRIDGE_BYTES) > bytes);
+	CHECK(counter(c.fd, USBDRV_STAT_BRIDGE_ERRORS) == errors);
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_BRIDGE_STOP), EINVAL);
+
+	/* the source reads again once the bridge is down */
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 2000;
+	CHECK(set_params(c.fd, p) == 0);
+	CHECK(read(c.fd, buf, sizeof(buf)) > 0);
+}
+
+int set_filter(int fd, std::vector<usbdrv_filter_rule> &rules, std::uint32_t default_verdict)
+{
+	usbdrv_filter f{};
+	f.rules = reinterpret_cast<std::uintptr_t>(rules.data());
+	f.count = std::uint32_t(rules.size());
+	f.default_verdict = default_verdict;
+	return ioctl(fd, USBDRV_IOC_SET_FILTER, &f);
+}
+
+/* throw away what the receive pool took in before the filter changed */
+void drain(int fd)
+{
+	char buf[4096];
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	fcntl(fd, F_SETFL, flags);
+}
+
+usbdrv_filter_rule match_byte(std::uint32_t offset, std::uint8_t value, std::uint32_t verdict, std::uint32_t tag)
+{
+	usbdrv_filter_rule r{};
+	r.offset = offset;
+	r.match_len = 1;
+	r.mask[0] = 0xff;
+	r.value[0] = value;
+	r.verdict = verdict;
+	r.tag = tag;
+	return r;
+}
+
+void test_filter(Ctx &c)
+{
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 500;
+	CHECK(set_params(c.fd, p) == 0);
+
+	/* offsets that would wrap the bounds check, or lie beyond any receive buffer */
+	std::uint32_t buf_size = std::uint32_t(std::strtoul(read_attr(intf_attr(c, "rx_buf_size")).c_str(), nullptr, 0));
+	CHECK(buf_size >= 512);
+	std::vector<usbdrv_filter_rule> rules = {match_byte(0xfffffff0, 0, USBDRV_FILTER_DROP, 0)};
+	rules[0].match_len = 4;
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_KEEP), EINVAL);
+	rules[0] = match_byte(buf_size, 0, USBDRV_FILTER_DROP, 0);
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_KEEP), EINVAL);
+	rules[0] = match_byte(0, 0, USBDRV_FILTER_DROP, 0);
+	rules[0].match_len = USBDRV_FILTER_MATCH_MAX + 1;
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_KEEP), EINVAL);
+	rules[0] = match_byte(0, 0, USBDRV_FILTER_TAG, 0);
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_KEEP), EINVAL);
+	rules[0] = match_byte(0, 0, USBDRV_NR_FILTER_VERDICTS, 0);
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_KEEP), EINVAL);
+	rules[0] = match_byte(0, 0, USBDRV_FILTER_DROP, 0);
+	rules[0].min_len = 100;
+	rules[0].max_len = 10;
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_KEEP), EINVAL);
+	rules[0].min_len = rules[0].max_len = 0;
+	CHECK_ERR(set_filter(c.fd, rules, USBDRV_FILTER_TAG), EINVAL);
+	std::vector<usbdrv_filter_rule> many(USBDRV_FILTER_MAX_RULES + 1, rules[0]);
+	CHECK_ERR(set_filter(c.fd, many, USBDRV_FILTER_KEEP), EINVAL);
+
+	/* the last byte of a buffer is accepted; g_zero never sends 0 there */
+	char buf[16];
+	rules[0] = match_byte(buf_size - 1, 0, USBDRV_FILTER_DROP, 0);
+	CHECK(set_filter(c.fd, rules, USBDRV_FILTER_KEEP) == 0);
+	drain(c.fd);
+	std::uint64_t dropped = counter(c.fd, USBDRV_STAT_FILTER_DROPPED);
+	CHECK(read(c.fd, buf, 10) == 10);
+	CHECK(counter(c.fd, USBDRV_STAT_FILTER_DROPPED) == dropped);
+
+	/* byte 1 of g_zero's pattern is 1: tag every transfer */
+	rules[0] = match_byte(1, 1, USBDRV_FILTER_TAG, 7);
+	CHECK(set_filter(c.fd, rules, USBDRV_FILTER_KEEP) == 0);
+	drain(c.fd);
+	std::uint64_t tagged = counter(c.fd, USBDRV_STAT_FILTER_TAGGED);
+	CHECK(read(c.fd, buf, 10) == 10);
+	std::uint32_t tag = 0;
+	CHECK(ioctl(c.fd, USBDRV_IOC_RX_TAG, &tag) == 0 && tag == 7);
+	CHECK(counter(c.fd, USBDRV_STAT_FILTER_TAGGED) > tagged);
+
+	/* a rule on length alone drops everything: reads time out */
+	rules[0] = usbdrv_filter_rule{};
+	rules[0].verdict = USBDRV_FILTER_DROP;
+	CHECK(set_filter(c.fd, rules, USBDRV_FILTER_KEEP) == 0);
+	drain(c.fd);
+	dropped = counter(c.fd, USBDRV_STAT_FILTER_DROPPED);
+	CHECK_ERR(read(c.fd, buf, 10), ETIMEDOUT);
+	CHECK(counter(c.fd, USBDRV_STAT_FILTER_DROPPED) > dropped);
+
+	/* the filter is per device: take it away for the other cases */
+	rules.clear();
+	CHECK(set_filter(c.fd, rules, USBDRV_FILTER_KEEP) == 0);
+	drain(c.fd);
+	CHECK(read(c.fd, buf, 10) == 10);
+}
+
+/* CRC-32C as the driver computes it, bitwise */
+std::uint32_t crc32c(const unsigned char *p, size_t len)
+{
+	std::uint32_t crc = ~0u;
+	while (len--) {
+		crc ^= *p++;
+		for (int k = 0; k < 8; ++k)
+			crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+/* loopback: a write comes back as one received transfer of the same length */
+void test_crc(Ctx &c)
+{
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 2000;
+	p.crc_flags = USBDRV_CRC_APPEND_TX | USBDRV_CRC_VERIFY_RX;
+	CHECK(set_params(c.fd, p) == 0);
+
+	unsigned char out[100], in[200];
+	for (size_t i = 0; i < sizeof(out); ++i)
+		out[i] = (unsigned char)(i * 7);
+	std::uint64_t ok = counter(c.fd, USBDRV_STAT_CRC_RX_OK);
+	std::uint64_t tx = counter(c.fd, USBDRV_STAT_CRC_TX);
+	CHECK(write(c.fd, out, sizeof(out)) == ssize_t(sizeof(out)));
+	/* take a little so the record is there to look at */
+	CHECK(read(c.fd, in, 4) == 4);
+	usbdrv_rx_record rec{};
+	CHECK(ioctl(c.fd, USBDRV_IOC_RX_RECORD, &rec) == 0);
+	CHECK(rec.length == sizeof(out) + USBDRV_CRC_SIZE && rec.offset == 4 && rec.flags == 0);
+	/* the trailer is delivered with the data */
+	CHECK(read(c.fd, in + 4, sizeof(in) - 4) == ssize_t(rec.length - 4));
+	CHECK(!std::memcmp(in, out, sizeof(out)));
+	std::uint32_t crc = crc32c(out, sizeof(out));
+	CHECK(in[100] == (crc & 0xff) && in[101] == ((crc >> 8) & 0xff) && in[102] == ((crc >> 16) & 0xff) &&
+	      in[103] == crc >> 24);
+	CHECK(counter(c.fd, USBDRV_STAT_CRC_TX) == tx + 1);
+	CHECK(counter(c.fd, USBDRV_STAT_CRC_RX_OK) == ok + 1);
+
+	/* without a trailer the receiving side flags the transfer */
+	p.crc_flags = USBDRV_CRC_VERIFY_RX;
+	CHECK(set_params(c.fd, p) == 0);
+	std::uint64_t bad = counter(c.fd, USBDRV_STAT_CRC_RX_BAD);
+	CHECK(write(c.fd, out, sizeof(out)) == ssize_t(sizeof(out)));
+	CHECK(read(c.fd, in, 4) == 4);
+	CHECK(ioctl(c.fd, USBDRV_IOC_RX_RECORD, &rec) == 0);
+	CHECK(rec.length == sizeof(out) && rec.flags == USBDRV_RX_CRC_BAD);
+	CHECK(read(c.fd, in + 4, sizeof(in) - 4) == ssize_t(sizeof(out) - 4));
+	CHECK(counter(c.fd, USBDRV_STAT_CRC_RX_BAD) == bad + 1);
+
+	/* synchronous writes and submitted ones count the caller's bytes, not the trailer */
+	p.crc_flags = USBDRV_CRC_APPEND_TX | USBDRV_CRC_VERIFY_RX;
+	p.io_mode = USBDRV_IO_SYNC;
+	p.write_timeout_ms = 2000;
+	CHECK(set_params(c.fd, p) == 0);
+	CHECK(write(c.fd, out, sizeof(out)) == ssize_t(sizeof(out)));
+	CHECK(read(c.fd, in, sizeof(in)) == ssize_t(sizeof(out) + USBDRV_CRC_SIZE));
+	CHECK(!std::memcmp(in, out, sizeof(out)));
+	std::vector<usbdrv_xfer> xfers = {make_xfer(out, sizeof(out), USBDRV_XFER_OUT, 9)};
+	CHECK(submit(c.fd, xfers) == 1);
+	auto comp = reap(c.fd, 1);
+	CHECK(comp.size() == 1 && comp[0].status == 0 && comp[0].actual_length == sizeof(out));
+	CHECK(read(c.fd, in, sizeof(in)) == ssize_t(sizeof(out) + USBDRV_CRC_SIZE));
+}
+
+usbdrv_ctrl_xfer ctrl(std::uint8_t type, std::uint8_t req, std::uint16_t value, std::uint16_t index, void *data,
+		      std::uint16_t len)
+{
+	usbdrv_ctrl_xfer x{};
+	x.bRequestType = type;
+	x.bRequest = req;
+	x.wValue = value;
+	x.wIndex = index;
+	x.wLength = len;
+	x.data = reinterpret_cast<std::uintptr_t>(data);
+	x.status = 1;
+	return x;
+}
+
+/* runs @xfers, returns the ioctl's result; @completed gets the count that succeeded */
+int ctrl_batch(int fd, std::vector<usbdrv_ctrl_xfer> &xfers, std::uint32_t flags, std::uint32_t *completed,
+	       std::uint32_t max_inflight = 0)
+{
+	usbdrv_ctrl_batch b{};
+	b.max_inflight = max_inflight;
+	b.xfers = reinterpret_cast<std::uintptr_t>(xfers.data());
+	b.count = std::uint32_t(xfers.size());
+	b.flags = flags;
+	b.timeout_ms = 1000;
+	int ret = ioctl(fd, USBDRV_IOC_CTRL_BATCH, &b);
+	if (completed)
+		*completed = b.completed;
+	return ret;
+}
+
+/*
+ * g_zero's vendor requests 0x5b and 0x5c write and read back its ep0 buffer,
+ * as usbtest uses them; requests naming another interface or endpoint, and
+ * standard OUT requests, never reach the device.
+ */
+void test_ctrl(Ctx &c)
+{
+	unsigned char out[64], in[64], desc[18] = {};
+	for (size_t i = 0; i < sizeof(out); ++i)
+		out[i] = (unsigned char)(0xa0 ^ i);
+	std::memset(in, 0, sizeof(in));
+	enum { VENDOR_OUT = 0x40, VENDOR_IN = 0xc0, STD_IN = 0x80, IFACE = 0x01, ENDPOINT = 0x02 };
+	std::vector<usbdrv_ctrl_xfer> xfers = {
+		ctrl(VENDOR_OUT, 0x5b, 0, 0, out, sizeof(out)),
+		ctrl(VENDOR_IN, 0x5c, 0, 0, in, sizeof(in)),
+		ctrl(STD_IN, 6, 0x0100, 0, desc, sizeof(desc)),	/* GET_DESCRIPTOR(DEVICE) */
+		ctrl(0x00, 3, 1, 0, nullptr, 0),		/* SET_FEATURE(REMOTE_WAKEUP) */
+		ctrl(VENDOR_OUT | IFACE, 0x5b, 0, 5, out, 1),
+		ctrl(VENDOR_OUT | ENDPOINT, 0x5b, 0, 0x0f, out, 1),
+		ctrl(VENDOR_IN, 0x5c, 0, 0, in, USBDRV_CTRL_MAX_DATA + 1),
+	};
+	std::uint64_t runs = counter(c.fd, USBDRV_STAT_CTRL_XFERS);
+	std::uint32_t completed = 0;
+	CHECK(ctrl_batch(c.fd, xfers, 0, &completed) == 0);
+	CHECK(completed == 3);
+	CHECK(xfers[0].status == 0 && xfers[0].actual_length == sizeof(out));
+	CHECK(xfers[1].status == 0 && xfers[1].actual_length == sizeof(in));
+	CHECK(!std::memcmp(in, out, sizeof(out)));
+	CHECK(xfers[2].status == 0 && xfers[2].actual_length == sizeof(desc));
+	CHECK(desc[0] == 18 && desc[1] == 1 && desc[8] == 0x0a && desc[9] == 0x1a);
+	CHECK(xfers[3].status == -EPERM);
+	CHECK(xfers[4].status == -EPERM);
+	CHECK(xfers[5].status == -EPERM);
+	CHECK(xfers[6].status == -EINVAL);
+	CHECK(counter(c.fd, USBDRV_STAT_CTRL_XFERS) == runs + xfers.size());
+
+	/* after a failure the rest of the batch is called off; one at a time, so none has already run */
+	std::vector<usbdrv_ctrl_xfer> stop = {
+		ctrl(VENDOR_OUT | IFACE, 0x5b, 0, 5, out, 1),
+		ctrl(STD_IN, 6, 0x0100, 0, desc, sizeof(desc)),
+		ctrl(STD_IN, 6, 0x0100, 0, desc, sizeof(desc)),
+	};
+	CHECK(ctrl_batch(c.fd, stop, USBDRV_CTRL_STOP_ON_ERROR, &completed, 1) == 0);
+	CHECK(completed == 0);
+	CHECK(stop[0].status == -EPERM && stop[1].status == -ECANCELED && stop[2].status == -ECANCELED);
+
+	std::vector<usbdrv_ctrl_xfer> none;
+	CHECK_ERR(ctrl_batch(c.fd, none, 0, nullptr), EINVAL);
+	std::vector<usbdrv_ctrl_xfer> huge(USBDRV_CTRL_MAX_BATCH + 1, xfers[2]);
+	CHECK_ERR(ctrl_batch(c.fd, huge, 0, nullptr), EINVAL);
+	CHECK_ERR(ctrl_batch(c.fd, stop, 0x80, nullptr), EINVAL);
+}
+
+/* the bulk endpoint addresses of the device's first interface, from its configuration descriptor */
+bool bulk_endpoints(int fd, std::uint8_t &in, std::uint8_t &out)
+{
+	unsigned char cfg[512] = {};
+	std::vector<usbdrv_ctrl_xfer> get = {ctrl(0x80, 6, 0x0200, 0, cfg, sizeof(cfg))};
+	if (ctrl_batch(fd, get, 0, nullptr) < 0 || get[0].status)
+		return false;
+	in = out = 0;
+	for (std::uint32_t i = 0; i + 1 < get[0].actual_length && cfg[i] >= 2; i += cfg[i]) {
+		/* endpoint descriptors, bulk */
+		if (cfg[i + 1] != 5 || (cfg[i + 3] & 3) != 2)
+			continue;
+		std::uint8_t &ep = (cfg[i + 2] & 0x80) ? in : out;
+		if (!ep)
+			ep = cfg[i + 2];
+	}
+	return in && out;
+}
+
+/* SET_FEATURE(ENDPOINT_HALT), as the driver lets through for our own endpoints */
+bool halt(int fd, std::uint8_t ep)
+{
+	std::vector<usbdrv_ctrl_xfer> x = {ctrl(0x02, 3, 0, ep, nullptr, 0)};
+	return ctrl_batch(fd, x, 0, nullptr) == 0 && x[0].status == 0;
+}
+
+/*
+ * Loopback: writes queued behind a stall follow the one that stalled once
+ * the halt is cleared, in order, and a stalled read goes through after it.
+ */
+void test_stall(Ctx &c)
+{
+	std::uint8_t ep_in, ep_out;
+	CHECK(bulk_endpoints(c.fd, ep_in, ep_out));
+	if (!ep_in || !ep_out)
+		return;
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 2000;
+	CHECK(set_params(c.fd, p) == 0);
+
+	/* short records, so g_zero sends each back as a transfer of its own */
+	const int records = 8;
+	unsigned char buf[512];
+	std::uint64_t clears = counter(c.fd, USBDRV_STAT_CLEAR_HALTS);
+	std::uint64_t resubmits = counter(c.fd, USBDRV_STAT_RESUBMITS);
+	CHECK(halt(c.fd, ep_out));
+	for (int k = 0; k < records; ++k) {
+		std::memset(buf, k, 100);
+		CHECK(write(c.fd, buf, 100) == 100);
+	}
+	for (int k = 0; k < records; ++k) {
+		std::memset(buf, 0xff, sizeof(buf));
+		CHECK(read(c.fd, buf, sizeof(buf)) == 100);
+		CHECK(buf[0] == k && buf[99] == k);
+	}
+	CHECK(counter(c.fd, USBDRV_STAT_CLEAR_HALTS) > clears);
+	CHECK(counter(c.fd, USBDRV_STAT_RESUBMITS) > resubmits);
+
+	clears = counter(c.fd, USBDRV_STAT_CLEAR_HALTS);
+	CHECK(halt(c.fd, ep_in));
+	std::memset(buf, 0x5a, 100);
+	CHECK(write(c.fd, buf, 100) == 100);
+	std::memset(buf, 0, sizeof(buf));
+	CHECK(read(c.fd, buf, sizeof(buf)) == 100);
+	CHECK(buf[0] == 0x5a);
+	CHECK(counter(c.fd, USBDRV_STAT_CLEAR_HALTS) > clears);
+}
+
+void test_prio(Ctx &c)
+{
+	std::uint32_t prio = USBDRV_PRIO_HIGH;
+	CHECK(ioctl(c.fd, USBDRV_IOC_SET_PRIO, &prio) == 0);
+	prio = USBDRV_PRIO_BULK;
+	CHECK(ioctl(c.fd, USBDRV_IOC_GET_PRIO, &prio) == 0 && prio == USBDRV_PRIO_HIGH);
+	CHECK(get_params(c.fd).prio == USBDRV_PRIO_HIGH);
+
+	std::uint64_t high = counter(c.fd, USBDRV_STAT_WRITES_HIGH);
+	std::vector<char> buf(512);
+	for (int i = 0; i < 4; ++i)
+		CHECK(write(c.fd, buf.data(), buf.size()) == ssize_t(buf.size()));
+	CHECK(counter(c.fd, USBDRV_STAT_WRITES_HIGH) >= high + 4);
+
+	prio = USBDRV_NR_PRIO;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_SET_PRIO, &prio), EINVAL);
+}
+
+void test_pacing(Ctx &c)
+{
+	usbdrv_pacing pacing{};
+	pacing.rate = 64 * 1024;
+	pacing.burst = 4096;
+	CHECK(ioctl(c.fd, USBDRV_IOC_SET_PACING, &pacing) == 0);
+	pacing = {};
+	CHECK(ioctl(c.fd, USBDRV_IOC_GET_PACING, &pacing) == 0);
+	CHECK(pacing.rate == 64 * 1024 && pacing.burst == 4096);
+
+	/* one burst goes at once, the rest has to wait for tokens */
+	std::uint64_t paced = counter(c.fd, USBDRV_STAT_PACED);
+	std::vector<char> buf(4096);
+	for (int i = 0; i < 4; ++i)
+		CHECK(write(c.fd, buf.data(), buf.size()) == ssize_t(buf.size()));
+	usleep(200 * 1000);
+	CHECK(counter(c.fd, USBDRV_STAT_PACED) > paced);
+
+	pacing.burst = 0;
+	CHECK_ERR(ioctl(c.fd, USBDRV_IOC_SET_PACING, &pacing), EINVAL);
+	/* pacing is per device: leave it off for the other cases */
+	pacing = {};
+	CHECK(ioctl(c.fd, USBDRV_IOC_SET_PACING, &pacing) == 0);
+}
+
+/* wait up to @ms for power/runtime_status to read @want */
+bool wait_runtime_status(const Ctx &c, const char *want, int ms)
+{
+	for (int t = 0; t < ms; t += 50) {
+		if (read_attr(power_attr(c, "runtime_status")) == want)
+			return true;
+		usleep(50 * 1000);
+	}
+	return false;
+}
+
+/*
+ * Runtime PM: the idle device autosuspends and a write resumes it, while a
+ * latency-critical fd keeps it resumed for as long as the flag is set.
+ */
+void test_pm(Ctx &c)
+{
+	std::string control = read_attr(power_attr(c, "control"));
+	std::string delay = read_attr(power_attr(c, "autosuspend_delay_ms"));
+	CHECK(write_attr(power_attr(c, "autosuspend_delay_ms"), "200"));
+	CHECK(write_attr(power_attr(c, "control"), "auto"));
+
+	std::uint64_t suspends = counter(c.fd, USBDRV_STAT_SUSPENDS);
+	std::uint64_t resumes = counter(c.fd, USBDRV_STAT_RESUMES);
+	CHECK(wait_runtime_status(c, "suspended", 3000));
+	CHECK(counter(c.fd, USBDRV_STAT_SUSPENDS) > suspends);
+	std::vector<char> buf(512);
+	CHECK(write(c.fd, buf.data(), buf.size()) == ssize_t(buf.size()));
+	CHECK(counter(c.fd, USBDRV_STAT_RESUMES) > resumes);
+	CHECK(wait_runtime_status(c, "suspended", 3000));
+
+	usbdrv_params p = get_params(c.fd);
+	p.pm_flags = USBDRV_PM_LATENCY_CRITICAL;
+	CHECK(set_params(c.fd, p) == 0);
+	CHECK(read_attr(power_attr(c, "runtime_status")) == "active");
+	suspends = counter(c.fd, USBDRV_STAT_SUSPENDS);
+	usleep(1000 * 1000);
+	CHECK(read_attr(power_attr(c, "runtime_status")) == "active");
+	CHECK(counter(c.fd, USBDRV_STAT_SUSPENDS) == suspends);
+	p.pm_flags = 0;
+	CHECK(set_params(c.fd, p) == 0);
+	CHECK(wait_runtime_status(c, "suspended", 3000));
+
+	/* the other cases run with the device as it was */
+	write_attr(power_attr(c, "control"), control);
+	write_attr(power_attr(c, "autosuspend_delay_ms"), delay);
+}
+
+/*
+ * Threads: writers and readers sharing the one fd.  Each record is short, so
+ * g_zero sends it back as a transfer of its own and a read returns it whole;
+ * every one has to come back exactly once.
+ */
+void test_threads(Ctx &c)
+{
+	const int nthreads = 4, records = 200;
+	const size_t len = 64;
+	usbdrv_params p = get_params(c.fd);
+	p.read_timeout_ms = 1000;
+	CHECK(set_params(c.fd, p) == 0);
+
+	/* what each thread saw, checked once they are all done */
+	std::vector<int> werr(nthreads);
+	std::vector<std::vector<std::uint32_t>> got(nthreads);
+	std::vector<int> bad(nthreads);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; ++t) {
+		threads.emplace_back([&, t] {
+			unsigned char buf[len];
+			for (std::uint32_t k = 0; k < records; ++k) {
+				std::uint32_t tag = std::uint32_t(t) << 16 | k;
+				std::memset(buf, int(tag % 251), len);
+				std::memcpy(buf, &tag, sizeof(tag));
+				if (write(c.fd, buf, len) != ssize_t(len)) {
+					werr[t] = errno;
+					return;
+				}
+			}
+		});
+		threads.emplace_back([&, t] {
+			unsigned char buf[512];
+			ssize_t n;
+			/* the last reads wait out the timeout once everything is in */
+			while ((n = read(c.fd, buf, sizeof(buf))) > 0) {
+				std::uint32_t tag;
+				std::memcpy(&tag, buf, sizeof(tag));
+				if (n != ssize_t(len) || buf[len - 1] != tag % 251) {
+					bad[t]++;
+					continue;
+				}
+				got[t].push_back(tag);
+			}
+		});
+	}
+	for (auto &th : threads)
+		th.join();
+
+	std::vector<int> seen(nthreads * records);
+	for (int t = 0; t < nthreads; ++t) {
+		CHECK(werr[t] == 0);
+		CHECK(bad[t] == 0);
+		for (std::uint32_t tag : got[t]) {
+			std::uint32_t w = tag >> 16, k = tag & 0xffff;
+			CHECK(w < std::uint32_t(nthreads) && k < std::uint32_t(records));
+			if (w < std::uint32_t(nthreads) && k < std::uint32_t(records))
+				seen[w * records + k]++;
+		}
+	}
+	int lost = 0, dups = 0;
+	for (int n : seen) {
+		lost += n == 0;
+		dups += n > 1;
+	}
+	CHECK(lost == 0);
+	CHECK(dups == 0);
+}
+
+/*
+ * Unplug: a read waiting for data, a write waiting in the queue and a run
+ * of control batches all end with ENODEV soon after the driver is unbound.
+ * The interface is left unbound, so this case comes last.
+ */
+void test_unplug(Ctx &c)
+{
+	std::string intf = intf_name(c);
+	CHECK(!intf.empty());
+	int rfd = open(c.path.c_str(), O_RDWR | O_CLOEXEC);
+	int wfd = open(c.path.c_str(), O_RDWR | O_CLOEXEC);
+	CHECK(rfd >= 0 && wfd >= 0);
+	if (intf.empty() || rfd < 0 || wfd < 0) {
+		close(rfd);
+		close(wfd);
+		return;
+	}
+	usbdrv_params p = get_params(rfd);
+	p.read_timeout_ms = 0;
+	CHECK(set_params(rfd, p) == 0);
+	p = get_params(wfd);
+	p.io_mode = USBDRV_IO_SYNC;
+	p.write_timeout_ms = 0;
+	CHECK(set_params(wfd, p) == 0);
+	/* a trickle of tokens: the first write goes, the next one waits in the queue */
+	usbdrv_pacing pacing{};
+	pacing.rate = 1;
+	pacing.burst = 512;
+	CHECK(ioctl(c.fd, USBDRV_IOC_SET_PACING, &pacing) == 0);
+
+	using clock = std::chrono::steady_clock;
+	int err[3] = {};
+	clock::time_point end[3];
+	std::thread reader([&] {
+		char buf[4096];
+		while (read(rfd, buf, sizeof(buf)) > 0)
+			;
+		err[0] = errno;
+		end[0] = clock::now();
+	});
+	std::thread writer([&] {
+		char buf[4096] = {};
+		while (write(wfd, buf, sizeof(buf)) == ssize_t(sizeof(buf)))
+			;
+		err[1] = errno;
+		end[1] = clock::now();
+	});
+	std::thread controller([&] {
+		unsigned char data[8];
+		std::vector<usbdrv_ctrl_xfer> x = {ctrl(0xc0, 0x5c, 0, 0, data, sizeof(data))};
+		while (ctrl_batch(c.fd, x, 0, nullptr) == 0)
+			;
+		err[2] = errno;
+		end[2] = clock::now();
+	});
+	usleep(300 * 1000);
+	clock::time_point start = clock::now();
+	if (!write_attr("/sys/bus/usb/drivers/usbdev/unbind", intf)) {
+		/* nothing is going to wake the threads up */
+		std::perror("unbind");
+		std::_Exit(1);
+	}
+	reader.join();
+	writer.join();
+	controller.join();
+	for (int i = 0; i < 3; ++i) {
+		CHECK(err[i] == ENODEV);
+		CHECK(end[i] - start < std::chrono::seconds(1));
+	}
+	close(rfd);
+	close(wfd);
+}
+
+struct Case {
+	const char *name;
+	void (*fn)(Ctx &);
+	bool loopback;		/* wants g_zero's loopback configuration */
+};
+
+const Case cases[] = {
+	{"params", test_params, false},
+	{"direct", test_direct, false},
+	{"read", test_read, false},
+	{"prio", test_prio, false},
+	{"submit", test_submit, false},
+	{"stripe", test_stripe, false},
+	{"bridge", test_bridge, false},
+	{"filter", test_filter, false},
+	{"ctrl", test_ctrl, false},
+	{"crc", test_crc, true},
+	{"stall", test_stall, true},
+	{"threads", test_threads, true},
+	{"pacing", test_pacing, false},
+	{"pm", test_pm, false},
+	{"unplug", test_unplug, true},		/* unbinds the driver, keep it last */
+};
+
+[[noreturn]] void usage(const char *prog)
+{
+	std::fprintf(stderr, "usage: %s -d dev -m minor case...\n       %s -l [sourcesink|loopback]\n", prog, prog);
+	std::exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	Ctx ctx{"", 0, -1};
+	bool list = false, have_minor = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:lh")) != -1) {
+		switch (opt) {
+		case 'd':
+			ctx.path = optarg;
+			break;
+		case 'm':
+			ctx.minor = unsigned(std::strtoul(optarg, nullptr, 0));
+			have_minor = true;
+			break;
+		case 'l':
+			list = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (list) {
+		/* the cases for one configuration, for the script */
+		bool loopback = optind < argc && !std::strcmp(argv[optind], "loopback");
+		for (auto &k : cases)
+			if (k.loopback == loopback)
+				std::printf("%s\n", k.name);
+		return 0;
+	}
+	if (ctx.path.empty() || !have_minor || optind == argc)
+		usage(argv[0]);
+
+	for (int i = optind; i < argc; ++i) {
+		const Case *k = nullptr;
+		for (auto &cand : cases)
+			if (!std::strcmp(cand.name, argv[i]))
+				k = &cand;
+		if (!k) {
+			std::fprintf(stderr, "%s: no such case\n", argv[i]);
+			return 2;
+		}
+		ctx.fd = open(ctx.path.c_str(), O_RDWR | O_CLOEXEC);
+		if (ctx.fd < 0) {
+			std::perror(ctx.path.c_str());
+			return 1;
+		}
+		int before = failures;
+		k->fn(ctx);
+		close(ctx.fd);
+		std::printf("%-10s %s\n", k->name, failures == before ? "ok" : "FAILED");
+	}
+	return failures ? 1 : 0;
+}
@@ -23,6 +23,27 @@
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include <linux/device.h>
+#include <linux/usb/hcd.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+#include <linux/pm_runtime.h>
+#include <linux/miscdevice.h>
+#include <linux/crc32c.h>
+#include <linux/timex.h>
+#include <linux/unaligned.h>
+#include "usbdrv_ioctl.h"
 
 /*Driver INFO*/
 MODULE_LICENSE("GPL");
@@ -55,171 +76,2631 @@ MODULE_DEVICE_TABLE(usb,usb_table);
 
 /* Get a minor range for your devices from the usb maintainer */
 #define USB_SKEL_MINOR_BASE	192
+/* read timeout of a freshly opened fd, the old HZ*10 */
+#define USBDRV_READ_TIMEOUT_MS	10000
+/* largest zero-copy read; the controller's sg_tablesize may cap it further */
+#define USBDRV_MAX_DIRECT	(4 * 1024 * 1024)
+/* largest receive buffer, a PMD sized huge page on x86 */
+#define USBDRV_RX_MAX_ORDER	9
+
+/* Write queue limits, see usbdrv_write_kick().  0 would stall every write, so it reads as 1. */
+static int usbdrv_param_set_limit(const char *val, const struct kernel_param *kp){
+	unsigned int n;
+	int retval=kstrtouint(val,0,&n);
+	if(retval)
+		return retval;
+	*(unsigned int *)kp->arg=max(n,1U);
+	return 0;
+}
+
+static const struct kernel_param_ops usbdrv_limit_ops={
+	.set=usbdrv_param_set_limit,
+	.get=param_get_uint,
+};
+
+static unsigned int writes_queued = 64;
+module_param_cb(writes_queued, &usbdrv_limit_ops, &writes_queued, 0644);
+MODULE_PARM_DESC(writes_queued, "Writes queued or in flight per device and priority class (default 64)");
+static unsigned int writes_in_flight = 8;
+module_param_cb(writes_in_flight, &usbdrv_limit_ops, &writes_in_flight, 0644);
+MODULE_PARM_DESC(writes_in_flight, "Write urbs in flight per device and priority class (default 8)");
+static unsigned int bulk_inflight_kb = 64;
+module_param(bulk_inflight_kb, uint, 0644);
+MODULE_PARM_DESC(bulk_inflight_kb, "KiB of bulk priority data in flight ahead of urgent writes (default 64)");
+static unsigned int direct_read_kb = 64;
+module_param(direct_read_kb, uint, 0644);
+MODULE_PARM_DESC(direct_read_kb, "Reads of at least this many KiB go straight to user pages, 0 = never (default 64)");
+static unsigned int urb_pool_size = 32;
+module_param(urb_pool_size, uint, 0444);
+MODULE_PARM_DESC(urb_pool_size, "Idle urbs kept per device for reuse (default 32)");
+static unsigned int recover_retries = 8;
+module_param(recover_retries, uint, 0644);
+MODULE_PARM_DESC(recover_retries, "Consecutive transfer errors recovered before they reach userspace (default 8)");
+static unsigned int recover_backoff_max_ms = 1000;
+module_param(recover_backoff_max_ms, uint, 0644);
+MODULE_PARM_DESC(recover_backoff_max_ms, "Ceiling of the recovery backoff in ms (default 1000)");
+static int autosuspend_ms = 2000;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before the device is runtime suspended, negative leaves it to userspace (default 2000)");
+static unsigned int ctrl_in_flight = 8;
+module_param(ctrl_in_flight, uint, 0644);
+MODULE_PARM_DESC(ctrl_in_flight, "Control transfers of a USBDRV_IOC_CTRL_BATCH queued at once by default (default 8)");
+static unsigned int stripe_chunk_kb = 64;
+module_param(stripe_chunk_kb, uint, 0444);
+MODULE_PARM_DESC(stripe_chunk_kb, "Initial chunk size of the striped aggregate in KiB (default 64)");
+static unsigned int rx_bufs = 16;
+module_param(rx_bufs, uint, 0444);
+MODULE_PARM_DESC(rx_bufs, "Receive buffers per device (default 16)");
+static unsigned int rx_buf_order = 2;
+module_param(rx_buf_order, uint, 0444);
+MODULE_PARM_DESC(rx_buf_order, "Page order of each receive buffer, up to 9 for 2 MiB buffers (default 2)");
+static unsigned int probe_rx_bufs = 2;
+module_param(probe_rx_bufs, uint, 0644);
+MODULE_PARM_DESC(probe_rx_bufs, "Receive buffers allocated in probe, the rest follow in the background (default 2)");
+static bool rx_prearm;
+module_param(rx_prearm, bool, 0644);
+MODULE_PARM_DESC(rx_prearm, "Arm the receive pool at probe, so data is taken in before the first open (default off)");
+
 struct usb_dev {
 	struct usb_device* udev;                 /* the usb device for this device */
 	struct usb_interface * interface;       /* the interface for this device */
-	unsigned char * bulk_in_buffer;         /*the buffer to receive data */
-	size_t bulk_in_size;                   /*the size of the receive buffer */
+	size_t bulk_in_size;                   /*wMaxPacketSize of the bulk in endpoint */
 	__u8	bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
 	__u8	bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
 	struct kref kref;              
-	spinlock_t lock;
-	struct mutex  io_mutex;		/* synchronize I/O with disconnect */
+	spinlock_t lock;		/* protects the write queue below */
+	struct rw_semaphore io_rwsem;	/* I/O holds it shared, disconnect and bridge changes alone */
+	struct usb_anchor submitted;	/* write urbs handed to the host controller */
+	struct list_head wq[USBDRV_NR_PRIO];	/* writes waiting for submission, per priority class */
+	atomic_t wq_count[USBDRV_NR_PRIO];	/* writes queued or in flight, per priority class */
+	unsigned int wq_inflight[USBDRV_NR_PRIO];	/* writes submitted and not yet completed */
+	size_t bulk_inflight;		/* bytes of USBDRV_PRIO_BULK data submitted */
+	wait_queue_head_t wq_wait;	/* writers waiting for queue space */
+	int errors;			/* last write error, reported once */
+	bool gone;			/* disconnect() was called */
+	u64 pace_rate;			/* token bucket: bytes per second, 0 = off */
+	u32 pace_burst;			/* token bucket depth in bytes */
+	s64 pace_tokens;		/* bytes we may send now, negative = debt */
+	ktime_t pace_stamp;		/* last token refill */
+	ktime_t pace_since;		/* queue held for tokens since, 0 = not held */
+	struct hrtimer pace_timer;	/* restarts the queue when tokens are due */
+	spinlock_t urb_lock;		/* protects the urb pool */
+	struct urb **urb_pool;		/* idle urbs, reused instead of allocated per transfer */
+	unsigned int urb_pool_size;
+	unsigned int urb_pool_count;
+	spinlock_t rx_lock;		/* protects the receive pool state below */
+	struct usb_rxbuf *rx_bufs;	/* the receive pool, see usbdrv_rx_pool_init() */
+	unsigned int rx_nbufs;
+	size_t rx_buf_size;
+	struct device *rx_dma_dev;	/* the controller the pool is mapped for */
+	bool rx_premapped;		/* buffers carry their own DMA mapping */
+	struct list_head rx_free;	/* idle buffers */
+	struct list_head rx_ready;	/* completed buffers, oldest first */
+	unsigned int rx_nfree;
+	unsigned int rx_nready;
+	unsigned int rx_armed;		/* buffers submitted to the controller */
+	unsigned int rx_streamers;	/* fds in USBDRV_READ_STREAM mode */
+	unsigned int rx_readers;	/* reads waiting in usbdrv_read_pool() */
+	struct usb_anchor rx_anchor;	/* submitted receive urbs */
+	struct usb_anchor read_anchor;	/* direct reads in flight */
+	struct usb_anchor ctrl_anchor;	/* USBDRV_IOC_CTRL_BATCH transfers in flight */
+	struct work_struct warm_work;	/* fills the pools after probe */
+	wait_queue_head_t rx_wait;	/* readers waiting for rx_ready */
+	bool rx_halted;			/* receive side held for recovery or reset */
+	unsigned int rx_errors;		/* consecutive failed receive transfers */
+	bool wq_halted;			/* write queue held for recovery or reset, under lock */
+	struct list_head wq_retry[USBDRV_NR_PRIO];	/* writes to resubmit once recovered, in order */
+	u64 wq_seq;			/* next usb_wreq.seq or usb_async.seq, under lock */
+	bool resetting;			/* between pre_reset and post_reset */
+	unsigned long recover_flags;	/* USBDRV_HALT_* endpoints to clear */
+	spinlock_t recover_lock;	/* protects recover_backoff */
+	unsigned int recover_backoff;	/* ms before the next recovery, 0 after a success */
+	struct delayed_work recover_work;	/* clears halts and restarts the queues */
+	bool suspended;			/* between suspend and resume */
+	unsigned int suspend_gen;	/* bumped by every suspend, see usbdrv_parked() */
+	wait_queue_head_t resume_wait;	/* transfers stopped by a suspend wait here to start again */
+	struct list_head async_parked;	/* USBDRV_IOC_SUBMIT IN transfers stopped by a suspend, under lock */
+	unsigned long pm_flags;		/* USBDRV_PM_* */
+	ktime_t resume_stamp;		/* last resume */
+	u64 resume_latency_ns;		/* last resume to first byte moved */
+	ktime_t probe_stamp;		/* probe started */
+	u64 probe_ns;			/* time spent in probe */
+	u64 probe_first_byte_ns;	/* probe start to first byte moved */
+	struct usb_rx_filter *rx_filter;	/* receive filter or NULL, under rx_lock */
+	atomic_t crc_rx_users;		/* fds with USBDRV_CRC_VERIFY_RX, received transfers are checked while nonzero */
+	bool bridging;			/* receive pool feeds bridge_peer, under rx_lock */
+	struct usb_dev *bridge_peer;	/* bridge target, held until the bridge is stopped */
+	u32 bridge_flags;		/* USBDRV_SHORT_ZLP */
+	struct usb_anchor bridge_anchor;	/* receive buffers on their way out of bridge_peer */
+	struct list_head bridge_parked;	/* receive buffers to send once bridge_peer resumes, under rx_lock */
+	struct list_head bridge_node;	/* on bridge_peer->bridge_srcs while bridging */
+	struct list_head bridge_srcs;	/* devices bridging into this one, under park_mutex */
+	struct list_head clients;	/* open fds, under park_mutex */
+	struct mutex park_mutex;	/* protects the lists suspend walks; never held across a PM get */
+	struct mutex pm_mutex;		/* serializes lpm_holders transitions */
+	unsigned int lpm_holders;	/* latency-critical fds, LPM is off while nonzero */
+	atomic64_t stats[USBDRV_STAT_NR];	/* USBDRV_STAT_* counters */
+};
+
+/* usb_dev.recover_flags bits */
+#define USBDRV_HALT_IN		0
+#define USBDRV_HALT_OUT		1
+
+/* usb_dev.pm_flags bits */
+#define USBDRV_PM_TIMING	0	/* resumed, first byte not seen yet */
+#define USBDRV_PM_PROBE_TIMING	1	/* probed, first byte not seen yet */
+#define USBDRV_PM_PREARMED	2	/* the pool streams from probe on, see rx_prearm */
+
+/*
+ * One receive buffer.  The pages are allocated and mapped for DMA once at
+ * probe and recycled between transfers, so no urb pays for a mapping.
+ */
+struct usb_rxbuf {
+	struct list_head node;		/* on rx_free, rx_ready or bridge_parked, off them while armed or claimed by a reader */
+	struct usb_dev *dev;
+	struct urb *urb;
+	struct page *page;
+	void *data;
+	dma_addr_t dma;
+	size_t len;			/* bytes received */
+	size_t off;			/* bytes already handed to readers */
+	int status;
+	u32 tag;			/* from the receive filter, 0 = untagged */
+	u32 flags;			/* USBDRV_RX_* */
+	unsigned int gen;		/* bridge_peer's suspend_gen when sent on */
+};
+
+/* receive filter as set by USBDRV_IOC_SET_FILTER */
+struct usb_rx_filter {
+	unsigned int count;
+	u32 default_verdict;
+	struct usbdrv_filter_rule rule[];
+};
+
+/* per open file state */
+struct usb_client {
+	struct list_head node;		/* on dev->clients */
+	struct usb_dev *dev;
+	struct kref ref;		/* held by the open file and by each of its writes */
+	struct usbdrv_params params;	/* per-fd tunables, see USBDRV_IOC_SET_PARAMS */
+	atomic_t wq_count;		/* writes of this fd queued or in flight */
+	spinlock_t async_lock;		/* protects async_done */
+	struct list_head async_done;	/* USBDRV_IOC_SUBMIT transfers waiting to be reaped */
+	atomic_t async_pending;		/* transfers submitted and not yet reaped */
+	wait_queue_head_t async_wait;	/* reapers waiting for completions */
+	struct usb_anchor async_anchor;	/* submitted IN transfers */
+	bool bridging;			/* this fd started the device's bridge */
+};
+
+enum { USBDRV_WREQ_QUEUED, USBDRV_WREQ_SUBMITTED, USBDRV_WREQ_DONE };
+
+/* one write, owned by the write queue until its urb completes */
+struct usb_wreq {
+	struct list_head node;
+	struct usb_dev *dev;
+	struct usb_client *client;
+	struct urb *urb;
+	size_t len;
+	unsigned int trailer;		/* bytes of @len that are our CRC trailer */
+	int prio;
+	int state;			/* USBDRV_WREQ_*, under dev->lock */
+	int status;			/* urb status once done */
+	unsigned int retries;		/* resubmissions after transfer errors */
+	u64 seq;			/* queueing order on the device, under dev->lock */
+	bool cancel;			/* the writer gave up, never park it for resubmission */
+	bool sync;			/* the writer waits on @done and frees the request */
+	struct completion done;
+	struct usb_async *async;	/* USBDRV_IOC_SUBMIT transfer to report to, or NULL */
+};
+
+/* one transfer of the submit/reap interface, see USBDRV_IOC_SUBMIT */
+struct usb_async {
+	struct list_head node;		/* on the client's async_done once complete, or on dev->async_parked */
+	struct usb_client *client;
+	unsigned int gen;		/* dev->suspend_gen when submitted */
+	u64 seq;			/* submission order on the device, under dev->lock */
+	struct urb *urb;		/* IN transfers; OUT ones ride a usb_wreq */
+	u64 user_data;
+	u64 buffer;			/* user address of the IN data */
+	u32 dir;			/* USBDRV_XFER_* */
+	s32 status;
+	u32 actual_length;
+	u64 timestamp_ns;
 };
 /*krefs allow you to add reference counters to your objects.  If you
  * have objects that are used in multiple places and passed around, and
  * you don't have refcounts, your code is almost certainly broken.  If
  * you want refcounts, krefs are the way to go.*/
 
-/*Macro sets up a pointer that points to the struct device_driver passed to the code . The macro to get a pointer to struct usb_dev by using:*/
-#define to_usb_dev(d) container_of(d, struct usb_dev, kref);
-static struct usb_driver usb_drv;
-static void usb_delete(struct kref *ref){
-	struct usb_dev *dev=to_usb_dev(ref);
-	usb_put_dev(dev->udev); /*release a use of the usb device structure.Must be called when a user of a device is finished with it*/
-	kfree(dev->bulk_in_buffer);  /*Free buffer*/
-	kfree (dev);   /*Free device*/
+/*Macro sets up a pointer that points to the struct device_driver passed to the code . The macro to get a pointer to struct usb_dev by using:*/
+#define to_usb_dev(d) container_of(d, struct usb_dev, kref);
+static struct usb_driver usb_drv;
+/* orders lookups by minor from the bridge and stripe ioctls against disconnect */
+static DEFINE_MUTEX(usbdrv_lookup_mutex);
+
+static void usbdrv_rx_pool_free(struct usb_dev *dev){
+	struct usb_rxbuf *rxb;
+	unsigned int i;
+	for(i=0; i < dev->rx_nbufs; ++i){
+		rxb=&dev->rx_bufs[i];
+		if(dev->rx_premapped)
+			dma_unmap_single(dev->rx_dma_dev,rxb->dma,dev->rx_buf_size,DMA_FROM_DEVICE);
+		__free_pages(rxb->page,get_order(dev->rx_buf_size));
+		usb_free_urb(rxb->urb);
+	}
+	kfree(dev->rx_bufs);
+}
+
+/* Allocate and map one receive buffer of 2^@order pages */
+static int usbdrv_rx_buf_init(struct usb_dev *dev, struct usb_rxbuf *rxb, unsigned int order){
+	struct page *page;
+	page=alloc_pages(GFP_KERNEL | __GFP_NOWARN,order);
+	if(!page)
+		return -ENOMEM;
+	rxb->dev=dev;
+	rxb->page=page;
+	rxb->data=page_address(page);
+	rxb->urb=usb_alloc_urb(0,GFP_KERNEL);
+	if(!rxb->urb)
+		goto free_page;
+	if(dev->rx_premapped){
+		rxb->dma=dma_map_single(dev->rx_dma_dev,rxb->data,PAGE_SIZE << order,DMA_FROM_DEVICE);
+		if(dma_mapping_error(dev->rx_dma_dev,rxb->dma))
+			goto free_urb;
+	}
+	return 0;
+free_urb:
+	usb_free_urb(rxb->urb);
+free_page:
+	__free_pages(page,order);
+	return -ENOMEM;
+}
+
+/*
+ * Set up the receive pool with its first buffer; usbdrv_rx_pool_grow() adds
+ * the rest, a few in probe and the others from warm_work.  If rx_buf_order
+ * can't be had the buffers get smaller rather than probe failing, and if
+ * memory runs out part way the pool is simply shorter; rx_bufs/rx_buf_size
+ * in sysfs tell what we ended up with.
+ */
+static int usbdrv_rx_pool_init(struct usb_dev *dev){
+	struct usb_bus *bus=dev->udev->bus;
+	unsigned int order=min_t(unsigned int,rx_buf_order,USBDRV_RX_MAX_ORDER);
+	unsigned int want=max_t(unsigned int,rx_bufs,1);
+	dev->rx_bufs=kcalloc(want,sizeof(*dev->rx_bufs),GFP_KERNEL);
+	if(!dev->rx_bufs)
+		return -ENOMEM;
+	dev->rx_dma_dev=bus->sysdev;
+	dev->rx_premapped=hcd_uses_dma(bus_to_hcd(bus));
+	while(usbdrv_rx_buf_init(dev,&dev->rx_bufs[0],order)){
+		if(!order)
+			return -ENOMEM;
+		order--;
+	}
+	list_add_tail(&dev->rx_bufs[0].node,&dev->rx_free);
+	dev->rx_nbufs=1;
+	dev->rx_nfree=1;
+	dev->rx_buf_size=PAGE_SIZE << order;
+	return 0;
+}
+static void usb_delete(struct kref *ref){
+	struct usb_dev *dev=to_usb_dev(ref);
+	while(dev->urb_pool_count)
+		usb_free_urb(dev->urb_pool[--dev->urb_pool_count]);
+	kfree(dev->urb_pool);
+	usbdrv_rx_pool_free(dev);
+	kfree(dev->rx_filter);
+	usb_put_intf(dev->interface);
+	usb_put_dev(dev->udev); /*release a use of the usb device structure.Must be called when a user of a device is finished with it*/
+	kfree (dev);   /*Free device*/
+}
+
+static void usbdrv_stat_add(struct usb_dev *dev, int idx, u64 val){
+	atomic64_add(val,&dev->stats[idx]);
+}
+
+/*
+ * Errors worth another try: a stall once the halt is cleared, and the bus
+ * level glitches (CRC, bitstuff, timeout) that usually don't repeat.
+ */
+static bool usbdrv_recoverable(int status){
+	return status == -EPIPE || status == -EPROTO || status == -EILSEQ || status == -ETIME;
+}
+
+/*
+ * Hold off the failing side and let the recovery worker restart it.  A
+ * stalled endpoint gets a clear-halt; repeated errors back off exponentially
+ * up to recover_backoff_max_ms instead of hammering the device.
+ */
+static void usbdrv_recover_schedule(struct usb_dev *dev, int status, int halt_bit){
+	unsigned long flags;
+	unsigned int delay;
+	if(status == -EPIPE)
+		set_bit(halt_bit,&dev->recover_flags);
+	spin_lock_irqsave(&dev->recover_lock,flags);
+	delay=dev->recover_backoff;
+	dev->recover_backoff=delay ? min(delay * 2,recover_backoff_max_ms) : 1;
+	spin_unlock_irqrestore(&dev->recover_lock,flags);
+	schedule_delayed_work(&dev->recover_work,msecs_to_jiffies(delay));
+}
+
+/* A transfer went through, so the next error starts a fresh backoff */
+static void usbdrv_recover_reset_backoff(struct usb_dev *dev){
+	unsigned long flags;
+	if(!READ_ONCE(dev->recover_backoff))
+		return;
+	spin_lock_irqsave(&dev->recover_lock,flags);
+	dev->recover_backoff=0;
+	spin_unlock_irqrestore(&dev->recover_lock,flags);
+}
+
+/*
+ * Runtime PM references.  Every write and read holds the device awake until
+ * it is done; the release may come from a completion handler.  Once
+ * disconnect() ran, usbcore drops whatever references are left.
+ */
+static int usbdrv_pm_get(struct usb_dev *dev){
+	return usb_autopm_get_interface(dev->interface);
+}
+
+static void usbdrv_pm_put(struct usb_dev *dev){
+	if(!READ_ONCE(dev->gone))
+		usb_autopm_put_interface_async(dev->interface);
+}
+
+/*
+ * A reference for I/O that doesn't hold io_rwsem throughout.  usbcore only
+ * drops references taken before disconnect() returns; checking gone and
+ * taking it under io_rwsem orders both before disconnect's barrier.
+ */
+static int usbdrv_pm_get_io(struct usb_dev *dev){
+	int retval=down_read_interruptible(&dev->io_rwsem);
+	if(retval)
+		return retval;
+	retval=dev->gone ? -ENODEV : usbdrv_pm_get(dev);
+	up_read(&dev->io_rwsem);
+	return retval;
+}
+
+/* Data moved: close the resume- and probe-to-first-byte measurements, if open */
+static void usbdrv_pm_first_byte(struct usb_dev *dev){
+	u64 ns;
+	usb_mark_last_busy(dev->udev);
+	if(test_and_clear_bit(USBDRV_PM_PROBE_TIMING,&dev->pm_flags))
+		WRITE_ONCE(dev->probe_first_byte_ns,ktime_to_ns(ktime_sub(ktime_get(),dev->probe_stamp)));
+	if(!test_and_clear_bit(USBDRV_PM_TIMING,&dev->pm_flags))
+		return;
+	ns=ktime_to_ns(ktime_sub(ktime_get(),dev->resume_stamp));
+	WRITE_ONCE(dev->resume_latency_ns,ns);
+	usbdrv_stat_add(dev,USBDRV_STAT_RESUME_FIRST_BYTE_NS,ns);
+}
+
+/*
+ * A latency-critical fd keeps the device resumed and, on USB 3, its link
+ * out of U1/U2 so no transfer pays the exit latency.
+ */
+static int usbdrv_pm_latency_hold(struct usb_dev *dev, bool on){
+	int retval=0;
+	mutex_lock(&dev->pm_mutex);
+	if(on){
+		retval=dev->gone ? -ENODEV : usbdrv_pm_get(dev);
+		if(retval)
+			goto out;
+		if(!dev->lpm_holders++ && usb_unlocked_disable_lpm(dev->udev))
+			dev_warn(&dev->interface->dev,"Couldn't disable link power management\n");
+	}else{
+		if(!--dev->lpm_holders && !dev->gone)
+			usb_unlocked_enable_lpm(dev->udev);
+		usbdrv_pm_put(dev);
+	}
+out:
+	mutex_unlock(&dev->pm_mutex);
+	return retval;
+}
+
+/* Take an idle urb from the device's pool, or allocate one if it is empty */
+static struct urb *usbdrv_urb_get(struct usb_dev *dev, gfp_t gfp){
+	struct urb *urb=NULL;
+	unsigned long flags;
+	spin_lock_irqsave(&dev->urb_lock,flags);
+	if(dev->urb_pool_count)
+		urb=dev->urb_pool[--dev->urb_pool_count];
+	spin_unlock_irqrestore(&dev->urb_lock,flags);
+	if(!urb)
+		return usb_alloc_urb(0,gfp);
+	urb->transfer_flags=0;
+	urb->sg=NULL;
+	urb->num_sgs=0;
+	return urb;
+}
+
+/*
+ * Give an urb back to the pool.  Safe from a completion handler: the core
+ * is done with the urb once the handler runs, as for a resubmission.
+ */
+static void usbdrv_urb_put(struct usb_dev *dev, struct urb *urb){
+	unsigned long flags;
+	spin_lock_irqsave(&dev->urb_lock,flags);
+	if(dev->urb_pool_count < dev->urb_pool_size){
+		dev->urb_pool[dev->urb_pool_count++]=urb;
+		urb=NULL;
+	}
+	spin_unlock_irqrestore(&dev->urb_lock,flags);
+	usb_free_urb(urb);
+}
+
+static void usbdrv_async_free(struct usb_dev *dev, struct usb_async *async);
+static void usbdrv_async_unpark(struct usb_dev *dev, struct usb_client *client);
+static int usbdrv_rx_set_stream(struct usb_dev *dev, bool on);
+static int usbdrv_bridge_stop(struct usb_client *client);
+
+static void usbdrv_client_free(struct kref *ref){
+	struct usb_client *client=container_of(ref,struct usb_client,ref);
+	struct usb_async *async, *tmp;
+	/* completions nobody reaped before close() */
+	list_for_each_entry_safe(async,tmp,&client->async_done,node)
+		usbdrv_async_free(client->dev,async);
+	kfree(client);
+}
+
+/*
+ * A pool armed at probe streams only until somebody opens the device; from
+ * then on the clients' read modes decide, and what it took in is still read
+ * first.  Holding it longer would keep the device from autosuspending.
+ */
+static void usbdrv_rx_prearm_end(struct usb_dev *dev){
+	if(test_and_clear_bit(USBDRV_PM_PREARMED,&dev->pm_flags))
+		usbdrv_rx_set_stream(dev,false);
+}
+
+/* New per-fd state with default parameters; holds a reference on @dev */
+static struct usb_client *usbdrv_client_alloc(struct usb_dev *dev){
+	struct usb_client *client;
+	client=kzalloc(sizeof(*client),GFP_KERNEL);
+	if(!client)
+		return NULL;
+	usbdrv_rx_prearm_end(dev);
+	client->dev=dev;
+	kref_init(&client->ref);
+	atomic_set(&client->wq_count,0);
+	spin_lock_init(&client->async_lock);
+	INIT_LIST_HEAD(&client->async_done);
+	atomic_set(&client->async_pending,0);
+	init_waitqueue_head(&client->async_wait);
+	init_usb_anchor(&client->async_anchor);
+	client->params.version=USBDRV_ABI_VERSION;
+	client->params.read_timeout_ms=USBDRV_READ_TIMEOUT_MS;
+	client->params.transfer_size=USBDRV_MAX_TRANSFER;
+	client->params.queue_depth=writes_queued;
+	client->params.io_mode=USBDRV_IO_ASYNC;
+	client->params.prio=USBDRV_PRIO_BULK;
+	/* increment our usage count for the device */
+	kref_get(&dev->kref);
+	return client;
+}
+
+/*
+ * The device bound to @minor, with a reference the caller has to put.  For
+ * ioctls naming another device; open() is kept from racing disconnect by
+ * usbcore, these are not.
+ */
+static struct usb_dev *usbdrv_dev_get(int minor){
+	struct usb_interface *interface;
+	struct usb_dev *dev;
+	mutex_lock(&usbdrv_lookup_mutex);
+	interface=usb_find_interface(&usb_drv,minor);
+	dev=interface ? usb_get_intfdata(interface) : NULL;
+	if(dev && !READ_ONCE(dev->gone))
+		kref_get(&dev->kref);
+	else
+		dev=ERR_PTR(-ENODEV);
+	mutex_unlock(&usbdrv_lookup_mutex);
+	return dev;
+}
+
+static int usb_open(struct inode *inodep, struct file *filep){
+	struct usb_client *client;
+	struct usb_dev *dev;
+	struct usb_interface *interface;
+	int subminor;
+	int retval=0;
+	/* Be sure to use iminor to obtain the minor number from the inode structure, and make sure that it corresponds to a device that your driver is actually prepared to handle.*/
+	subminor=iminor(inodep);   
+	interface=usb_find_interface(&usb_drv,subminor); /* find usb_interface pointer for driver and device */
+	if(!interface){
+		pr_err("%s: Can't find device for minor %d",__func__, subminor);
+		retval=-ENODEV;
+		goto exit;
+	}
+	dev = usb_get_intfdata(interface);	/* To retrieve the data, the function usb_get_intfdata should be called:*/
+	if(!dev){
+		retval=-ENODEV;
+		goto exit;
+	}
+	client=usbdrv_client_alloc(dev);
+	if(!client){
+		retval=-ENOMEM;
+		goto exit;
+	}
+	/* suspend stops its IN transfers */
+	mutex_lock(&dev->park_mutex);
+	list_add_tail(&client->node,&dev->clients);
+	mutex_unlock(&dev->park_mutex);
+	/* save our object in the file's private structure */
+	filep->private_data=client;
+	return 0;
+exit:
+	return retval;
+}
+static  int usb_release(struct inode *inodep, struct file *filep){
+	struct usb_client *client;
+	struct usb_dev *dev;
+	client=(struct usb_client *)filep->private_data;
+	if (client == NULL)
+		return -ENODEV;
+	dev=client->dev;
+	if(client->params.read_mode == USBDRV_READ_STREAM)
+		usbdrv_rx_set_stream(dev,false);
+	if(client->params.pm_flags & USBDRV_PM_LATENCY_CRITICAL)
+		usbdrv_pm_latency_hold(dev,false);
+	if(client->bridging)
+		usbdrv_bridge_stop(client);
+	if(client->params.crc_flags & USBDRV_CRC_VERIFY_RX)
+		atomic_dec(&dev->crc_rx_users);
+	mutex_lock(&dev->park_mutex);
+	list_del(&client->node);
+	mutex_unlock(&dev->park_mutex);
+	/* IN transfers are ours to stop; their completions are freed with the client */
+	usb_kill_anchored_urbs(&client->async_anchor);
+	usbdrv_async_unpark(dev,client);
+	/* writes still in flight keep the client until they complete */
+	kref_put(&client->ref,usbdrv_client_free);
+	/* decrement the count on our device */
+	kref_put(&dev->kref, usb_delete);
+	return 0;
+}
+
+static bool usbdrv_unlink_status(int status){
+	/* sync/async unlink faults aren't errors */
+	return status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN;
+}
+
+/*
+ * System suspend stops even the transfers that hold the device awake, and
+ * usbcore flushes whatever it still finds.  One stopped that way before it
+ * moved any data is started again after resume rather than failed: take
+ * usbdrv_suspend_mark() before submitting, ask usbdrv_parked() about the
+ * outcome.  The mark fails with -EHOSTUNREACH while the device is suspended.
+ */
+static int usbdrv_suspend_mark(struct usb_dev *dev, unsigned int *gen){
+	*gen=READ_ONCE(dev->suspend_gen);
+	/* pairs with usb_suspend(): a new suspend_gen comes with suspended set */
+	smp_rmb();
+	return READ_ONCE(dev->suspended) ? -EHOSTUNREACH : 0;
+}
+
+static bool usbdrv_parked(struct usb_dev *dev, unsigned int gen, int status, u32 actual){
+	if(actual || READ_ONCE(dev->gone))
+		return false;
+	if(!usbdrv_unlink_status(status) && status != -EHOSTUNREACH)
+		return false;
+	return READ_ONCE(dev->suspended) || READ_ONCE(dev->suspend_gen) != gen;
+}
+
+/* Sleep until the device has resumed; -ENODEV if it went away instead */
+static int usbdrv_wait_resumed(struct usb_dev *dev){
+	if(wait_event_interruptible(dev->resume_wait,!READ_ONCE(dev->suspended) || READ_ONCE(dev->gone)))
+		return -ERESTARTSYS;
+	return READ_ONCE(dev->gone) ? -ENODEV : 0;
+}
+
+static void usbdrv_read_callback(struct urb *urb){
+	complete(urb->context);
+}
+
+/*
+ * Submit a prepared bulk-in urb and wait for it, what usb_bulk_msg() does
+ * but with an interruptible wait.  A @timeout_ms of 0 waits until data
+ * arrives.  Data that made it before a timeout or signal is still returned.
+ */
+static int usbdrv_read_urb(struct urb *urb, struct completion *done, int *actual, unsigned int timeout_ms){
+	long left;
+	int retval;
+	*actual=0;
+	retval=usb_submit_urb(urb,GFP_KERNEL);
+	if(retval)
+		return retval;
+	left=wait_for_completion_interruptible_timeout(done,timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT);
+	if(left <= 0){
+		usb_kill_urb(urb);
+		retval=left ? -ERESTARTSYS : -ETIMEDOUT;
+		if(urb->actual_length)
+			retval=0;
+	}else{
+		retval=urb->status;
+	}
+	*actual=urb->actual_length;
+	return retval;
+}
+
+/*
+ * How much of a @count byte read at @buffer can go straight into the
+ * caller's pages, 0 if it has to take the buffered path.  The controller has
+ * to do scatter-gather, and unless it takes any sg layout every entry but the
+ * last must be whole packets, which holds when the buffer starts on a packet
+ * boundary within its page.
+ */
+static size_t usbdrv_direct_len(struct usb_dev *dev, const char __user *buffer, size_t count){
+	struct usb_bus *bus=dev->udev->bus;
+	unsigned int offset=offset_in_page(buffer);
+	size_t len;
+	if(!direct_read_kb || count < (size_t)direct_read_kb * 1024 || !bus->sg_tablesize)
+		return 0;
+	if(!bus->no_sg_constraint && offset % dev->bulk_in_size)
+		return 0;
+	len=min_t(size_t,count,USBDRV_MAX_DIRECT);
+	len=min_t(size_t,len,(size_t)bus->sg_tablesize * PAGE_SIZE - offset);
+	return len - len % dev->bulk_in_size;
+}
+
+/*
+ * Zero-copy read: pin the caller's pages and let the controller DMA into
+ * them through a scatter-gather urb, skipping bulk_in_buffer and the copy.
+ */
+static ssize_t usbdrv_read_direct(struct usb_dev *dev, struct usb_client *client, char __user *buffer, size_t len){
+	DECLARE_COMPLETION_ONSTACK(done);
+	unsigned long addr=(unsigned long)buffer;
+	unsigned int offset=offset_in_page(addr);
+	unsigned int nr_pages=DIV_ROUND_UP(offset + len,PAGE_SIZE);
+	struct page **pages;
+	struct sg_table sgt;
+	struct urb *urb;
+	unsigned int gen;
+	int pinned;
+	int actual;
+	ssize_t retval;
+	pages=kvmalloc_array(nr_pages,sizeof(*pages),GFP_KERNEL);
+	if(!pages)
+		return -ENOMEM;
+	pinned=pin_user_pages_fast(addr,nr_pages,FOLL_WRITE,pages);
+	if(pinned <= 0){
+		retval=pinned ? pinned : -EFAULT;
+		goto free_pages;
+	}
+	if(pinned < nr_pages){
+		/* read what we could pin, in whole packets */
+		len=(size_t)pinned * PAGE_SIZE - offset;
+		len-=len % dev->bulk_in_size;
+		if(!len){
+			retval=-EFAULT;
+			goto unpin;
+		}
+	}
+	retval=sg_alloc_table_from_pages(&sgt,pages,pinned,offset,len,GFP_KERNEL);
+	if(retval)
+		goto unpin;
+	urb=usbdrv_urb_get(dev,GFP_KERNEL);
+	if(!urb){
+		retval=-ENOMEM;
+		goto free_sgt;
+	}
+	usb_fill_bulk_urb(urb,dev->udev,usb_rcvbulkpipe(dev->udev,dev->bulk_in_endpointAddr),NULL,len,usbdrv_read_callback,&done);
+	urb->sg=sgt.sgl;
+	urb->num_sgs=sgt.orig_nents;
+	if(client->params.short_policy & USBDRV_SHORT_NOT_OK)
+		urb->transfer_flags|=URB_SHORT_NOT_OK;
+	for(;;){
+		actual=0;
+		retval=usbdrv_suspend_mark(dev,&gen);
+		if(!retval){
+			/* disconnect poisons the anchor, so this can't start behind its back */
+			usb_anchor_urb(urb,&dev->read_anchor);
+			retval=usbdrv_read_urb(urb,&done,&actual,client->params.read_timeout_ms);
+			usb_unanchor_urb(urb);
+		}
+		if(!usbdrv_parked(dev,gen,retval,actual))
+			break;
+		/* a suspend stopped it before any data came, read again once resumed */
+		retval=usbdrv_wait_resumed(dev);
+		if(retval)
+			break;
+		reinit_completion(&done);
+	}
+	usbdrv_urb_put(dev,urb);
+	if(retval && dev->gone)
+		retval=-ENODEV;
+	/* the reader gets the stall, the recovery worker clears it */
+	if(retval == -EPIPE)
+		usbdrv_recover_schedule(dev,retval,USBDRV_HALT_IN);
+	if(!retval){
+		retval=actual;
+		usbdrv_stat_add(dev,USBDRV_STAT_DIRECT_READS,1);
+		usbdrv_stat_add(dev,USBDRV_STAT_DIRECT_READ_BYTES,actual);
+	}
+free_sgt:
+	sg_free_table(&sgt);
+unpin:
+	unpin_user_pages_dirty_lock(pages,pinned,true);
+free_pages:
+	kvfree(pages);
+	return retval;
+}
+
+static int usbdrv_bridge_out(struct usb_dev *dev, struct usb_rxbuf *rxb);
+
+/*
+ * CRC-32C of @len bytes the way the protocol carries it (as iSCSI does),
+ * charging the cycles to the stats so the overhead of the mode shows.
+ */
+static u32 usbdrv_crc(struct usb_dev *dev, const void *data, size_t len){
+	cycles_t start=get_cycles();
+	u32 crc=~crc32c(~0,data,len);
+	usbdrv_stat_add(dev,USBDRV_STAT_CRC_CYCLES,get_cycles() - start);
+	usbdrv_stat_add(dev,USBDRV_STAT_CRC_BYTES,len);
+	return crc;
+}
+
+/* Check the little-endian CRC-32C trailer of a received transfer, while it is still hot */
+static void usbdrv_crc_verify(struct usb_dev *dev, struct usb_rxbuf *rxb){
+	if(rxb->len < USBDRV_CRC_SIZE ||
+	   usbdrv_crc(dev,rxb->data,rxb->len - USBDRV_CRC_SIZE) != get_unaligned_le32(rxb->data + rxb->len - USBDRV_CRC_SIZE)){
+		rxb->flags|=USBDRV_RX_CRC_BAD;
+		usbdrv_stat_add(dev,USBDRV_STAT_CRC_RX_BAD,1);
+	}else{
+		usbdrv_stat_add(dev,USBDRV_STAT_CRC_RX_OK,1);
+	}
+}
+
+static bool usbdrv_filter_match(const struct usbdrv_filter_rule *rule, const u8 *data, size_t len){
+	unsigned int i;
+	if(len < rule->min_len || (rule->max_len && len > rule->max_len))
+		return false;
+	if(rule->match_len > len || rule->offset > len - rule->match_len)
+		return false;
+	for(i=0; i < rule->match_len; ++i)
+		if((data[rule->offset + i] & rule->mask[i]) != rule->value[i])
+			return false;
+	return true;
+}
+
+/* Verdict of the receive filter on @rxb; sets its tag.  Called with dev->rx_lock held. */
+static u32 usbdrv_filter_run(struct usb_dev *dev, struct usb_rxbuf *rxb){
+	const struct usb_rx_filter *filter=dev->rx_filter;
+	u32 verdict=filter->default_verdict;
+	unsigned int i;
+	for(i=0; i < filter->count; ++i){
+		if(usbdrv_filter_match(&filter->rule[i],rxb->data,rxb->len)){
+			verdict=filter->rule[i].verdict;
+			break;
+		}
+	}
+	switch(verdict){
+	case USBDRV_FILTER_DROP:
+		usbdrv_stat_add(dev,USBDRV_STAT_FILTER_DROPPED,1);
+		usbdrv_stat_add(dev,USBDRV_STAT_FILTER_DROPPED_BYTES,rxb->len);
+		break;
+	case USBDRV_FILTER_TAG:
+		rxb->tag=filter->rule[i].tag;
+		usbdrv_stat_add(dev,USBDRV_STAT_FILTER_TAGGED,1);
+		break;
+	default:
+		usbdrv_stat_add(dev,USBDRV_STAT_FILTER_KEPT,1);
+		break;
+	}
+	return verdict;
+}
+
+static void usbdrv_rx_fill(struct usb_dev *dev);
+
+static void usbdrv_rx_callback(struct urb *urb){
+	struct usb_rxbuf *rxb=urb->context;
+	struct usb_dev *dev=rxb->dev;
+	bool recovered=false, wake=true;
+	unsigned long flags;
+	/* only what the device wrote has to be made visible */
+	if(dev->rx_premapped && urb->actual_length)
+		dma_sync_single_for_cpu(dev->rx_dma_dev,rxb->dma,urb->actual_length,DMA_FROM_DEVICE);
+	rxb->status=urb->status;
+	rxb->len=urb->actual_length;
+	rxb->off=0;
+	rxb->tag=0;
+	rxb->flags=0;
+	if(!urb->status && atomic_read(&dev->crc_rx_users))
+		usbdrv_crc_verify(dev,rxb);
+	spin_lock_irqsave(&dev->rx_lock,flags);
+	dev->rx_armed--;
+	if(urb->actual_length)
+		usbdrv_pm_first_byte(dev);
+	if(!urb->status){
+		dev->rx_errors=0;
+		usbdrv_recover_reset_backoff(dev);
+	}else if(!dev->gone && usbdrv_recoverable(urb->status) && dev->rx_errors < recover_retries){
+		/* hold the receive side and let the worker restart it; keep what did arrive */
+		dev->rx_errors++;
+		dev->rx_halted=true;
+		usbdrv_recover_schedule(dev,urb->status,USBDRV_HALT_IN);
+		rxb->status=0;
+		recovered=true;
+	}else if(usbdrv_recoverable(urb->status)){
+		usbdrv_stat_add(dev,USBDRV_STAT_RECOVERY_GIVEUPS,1);
+	}
+	if((recovered || usbdrv_unlink_status(rxb->status)) && !rxb->len){
+		/* cancelled or recovered without data, nothing for readers */
+		list_add_tail(&rxb->node,&dev->rx_free);
+		dev->rx_nfree++;
+	}else if(dev->rx_filter && !rxb->status && usbdrv_filter_run(dev,rxb) == USBDRV_FILTER_DROP){
+		/* noise: straight back to the pool, nobody is woken for it */
+		list_add_tail(&rxb->node,&dev->rx_free);
+		dev->rx_nfree++;
+		usbdrv_rx_fill(dev);
+		wake=dev->rx_armed < dev->rx_readers;
+	}else if(dev->bridging){
+		/* nobody reads a bridged device: what can't be sent on is dropped */
+		if((rxb->status && !usbdrv_unlink_status(rxb->status)) || usbdrv_bridge_out(dev,rxb)){
+			usbdrv_stat_add(dev,USBDRV_STAT_BRIDGE_ERRORS,1);
+			list_add_tail(&rxb->node,&dev->rx_free);
+			dev->rx_nfree++;
+			usbdrv_rx_fill(dev);
+		}else if(!dev->rx_armed && !dev->rx_nfree){
+			usbdrv_stat_add(dev,USBDRV_STAT_BRIDGE_THROTTLED,1);
+		}
+	}else{
+		list_add_tail(&rxb->node,&dev->rx_ready);
+		dev->rx_nready++;
+		usbdrv_stat_add(dev,USBDRV_STAT_RX_TRANSFERS,1);
+		usbdrv_stat_add(dev,USBDRV_STAT_RX_BYTES,urb->actual_length);
+		if(dev->rx_streamers && !dev->rx_armed)
+			usbdrv_stat_add(dev,USBDRV_STAT_RX_FULL,1);
+	}
+	spin_unlock_irqrestore(&dev->rx_lock,flags);
+	if(wake)
+		wake_up_interruptible(&dev->rx_wait);
+}
+
+/*
+ * Submit the first free receive buffer for @len bytes.  The buffer is still
+ * mapped from probe, it only needs handing back to the device.
+ * Called with dev->rx_lock held.
+ */
+static int usbdrv_rx_submit(struct usb_dev *dev, size_t len, unsigned int urb_flags){
+	struct usb_rxbuf *rxb=list_first_entry(&dev->rx_free,struct usb_rxbuf,node);
+	struct urb *urb=rxb->urb;
+	int retval;
+	if(dev->rx_premapped){
+		dma_sync_single_for_device(dev->rx_dma_dev,rxb->dma,len,DMA_FROM_DEVICE);
+		urb_flags|=URB_NO_TRANSFER_DMA_MAP;
+	}
+	usb_fill_bulk_urb(urb,dev->udev,usb_rcvbulkpipe(dev->udev,dev->bulk_in_endpointAddr),rxb->data,len,usbdrv_rx_callback,rxb);
+	urb->transfer_dma=rxb->dma;
+	urb->transfer_flags=urb_flags;
+	usb_anchor_urb(urb,&dev->rx_anchor);
+	retval=usb_submit_urb(urb,GFP_ATOMIC);
+	if(retval){
+		usb_unanchor_urb(urb);
+		return retval;
+	}
+	list_del(&rxb->node);
+	dev->rx_nfree--;
+	dev->rx_armed++;
+	return 0;
+}
+
+/* While anyone streams, keep every free buffer armed.  Called with dev->rx_lock held. */
+static void usbdrv_rx_fill(struct usb_dev *dev){
+	while(dev->rx_streamers && !dev->gone && !dev->rx_halted && dev->rx_nfree)
+		if(usbdrv_rx_submit(dev,dev->rx_buf_size,0))
+			break;
+}
+
+/* A reader is done with @rxb, which it claimed off rx_ready */
+static void usbdrv_rx_recycle(struct usb_dev *dev, struct usb_rxbuf *rxb){
+	bool wake;
+	spin_lock_irq(&dev->rx_lock);
+	list_add_tail(&rxb->node,&dev->rx_free);
+	dev->rx_nfree++;
+	usbdrv_rx_fill(dev);
+	/* a reader may be waiting for a buffer to arm */
+	wake=dev->rx_armed < dev->rx_readers;
+	spin_unlock_irq(&dev->rx_lock);
+	if(wake)
+		wake_up_interruptible(&dev->rx_wait);
+}
+
+/* Put what is left of a claimed @rxb back in front, for the next read */
+static void usbdrv_rx_unclaim(struct usb_dev *dev, struct usb_rxbuf *rxb){
+	spin_lock_irq(&dev->rx_lock);
+	list_add(&rxb->node,&dev->rx_ready);
+	dev->rx_nready++;
+	spin_unlock_irq(&dev->rx_lock);
+	wake_up_interruptible(&dev->rx_wait);
+}
+
+/*
+ * A streaming fd lets the device autosuspend only if it can wake us up when
+ * data arrives; otherwise it holds the device resumed.  Suspend parks the
+ * armed pool and resume re-arms it.
+ */
+static int usbdrv_rx_set_stream(struct usb_dev *dev, bool on){
+	bool wakeup=device_can_wakeup(&dev->udev->dev);
+	int retval;
+	if(on && READ_ONCE(dev->gone))
+		return -ENODEV;
+	if(on && !wakeup){
+		retval=usbdrv_pm_get(dev);
+		if(retval)
+			return retval;
+	}
+	spin_lock_irq(&dev->rx_lock);
+	if(on)
+		dev->rx_streamers++;
+	else
+		dev->rx_streamers--;
+	if(wakeup && !dev->gone)
+		dev->interface->needs_remote_wakeup=dev->rx_streamers > 0;
+	usbdrv_rx_fill(dev);
+	spin_unlock_irq(&dev->rx_lock);
+	if(!on && !wakeup)
+		usbdrv_pm_put(dev);
+	return 0;
+}
+
+/*
+ * Device-to-device bridge, see USBDRV_IOC_BRIDGE.  A filled receive buffer
+ * goes straight out of the peer's bulk-out endpoint and returns to the pool
+ * once sent.  The pool is the credit between the two sides: the IN side
+ * re-arms only as fast as the OUT side drains.
+ */
+static void usbdrv_bridge_out_callback(struct urb *urb){
+	struct usb_rxbuf *rxb=urb->context;
+	struct usb_dev *dev=rxb->dev;
+	unsigned long flags;
+	if(usbdrv_parked(dev->bridge_peer,rxb->gen,urb->status,urb->actual_length)){
+		usbdrv_urb_put(dev->bridge_peer,urb);
+		/* the peer's suspend kills newest first, so in front keeps the order */
+		spin_lock_irqsave(&dev->rx_lock,flags);
+		list_add(&rxb->node,&dev->bridge_parked);
+		spin_unlock_irqrestore(&dev->rx_lock,flags);
+		return;
+	}
+	if(urb->status){
+		usbdrv_stat_add(dev,USBDRV_STAT_BRIDGE_ERRORS,1);
+		/* the buffer is lost either way, but the peer's endpoint needs its halt cleared */
+		if(urb->status == -EPIPE && !dev->bridge_peer->gone)
+			usbdrv_recover_schedule(dev->bridge_peer,urb->status,USBDRV_HALT_OUT);
+	}else{
+		usbdrv_stat_add(dev,USBDRV_STAT_BRIDGE_XFERS,1);
+		usbdrv_stat_add(dev,USBDRV_STAT_BRIDGE_BYTES,urb->actual_length);
+	}
+	usbdrv_urb_put(dev->bridge_peer,urb);
+	spin_lock_irqsave(&dev->rx_lock,flags);
+	list_add_tail(&rxb->node,&dev->rx_free);
+	dev->rx_nfree++;
+	usbdrv_rx_fill(dev);
+	spin_unlock_irqrestore(&dev->rx_lock,flags);
+}
+
+/*
+ * Send @rxb on without copying it; usbcore maps the pages for the peer's
+ * controller.  -EAGAIN while the peer is suspended.  Called with
+ * dev->rx_lock held.
+ */
+static int usbdrv_bridge_send(struct usb_dev *dev, struct usb_rxbuf *rxb){
+	struct usb_dev *peer=dev->bridge_peer;
+	struct urb *urb;
+	int retval;
+	if(peer->gone)
+		return -ENODEV;
+	if(usbdrv_suspend_mark(peer,&rxb->gen))
+		return -EAGAIN;
+	urb=usbdrv_urb_get(peer,GFP_ATOMIC);
+	if(!urb)
+		return -ENOMEM;
+	usb_fill_bulk_urb(urb,peer->udev,usb_sndbulkpipe(peer->udev,peer->bulk_out_endpointAddr),rxb->data,rxb->len,
+			  usbdrv_bridge_out_callback,rxb);
+	if(dev->bridge_flags & USBDRV_SHORT_ZLP)
+		urb->transfer_flags|=URB_ZERO_PACKET;
+	usb_anchor_urb(urb,&dev->bridge_anchor);
+	retval=usb_submit_urb(urb,GFP_ATOMIC);
+	if(retval){
+		usb_unanchor_urb(urb);
+		usbdrv_urb_put(peer,urb);
+		/* a resume already past its unpark would leave it parked for good */
+		if(usbdrv_parked(peer,rxb->gen,retval,0) && READ_ONCE(peer->suspended))
+			retval=-EAGAIN;
+	}
+	return retval;
+}
+
+/*
+ * Send @rxb on, behind whatever a suspend of the peer holds back; the
+ * peer's resume sends those.  Called with dev->rx_lock held.
+ */
+static int usbdrv_bridge_out(struct usb_dev *dev, struct usb_rxbuf *rxb){
+	int retval=-EAGAIN;
+	if(list_empty(&dev->bridge_parked))
+		retval=usbdrv_bridge_send(dev,rxb);
+	if(retval != -EAGAIN)
+		return retval;
+	list_add_tail(&rxb->node,&dev->bridge_parked);
+	return 0;
+}
+
+/* The peer resumed: send on what its suspend held back, in order */
+static void usbdrv_bridge_unpark(struct usb_dev *dev){
+	struct usb_rxbuf *rxb;
+	int retval;
+	spin_lock_irq(&dev->rx_lock);
+	while(!list_empty(&dev->bridge_parked)){
+		rxb=list_first_entry(&dev->bridge_parked,struct usb_rxbuf,node);
+		list_del(&rxb->node);
+		retval=usbdrv_bridge_send(dev,rxb);
+		if(retval == -EAGAIN){
+			list_add(&rxb->node,&dev->bridge_parked);
+			break;
+		}
+		if(retval){
+			usbdrv_stat_add(dev,USBDRV_STAT_BRIDGE_ERRORS,1);
+			list_add_tail(&rxb->node,&dev->rx_free);
+			dev->rx_nfree++;
+		}
+	}
+	usbdrv_rx_fill(dev);
+	spin_unlock_irq(&dev->rx_lock);
+}
+
+static int usbdrv_bridge_start(struct usb_client *client, const struct usbdrv_bridge *br){
+	struct usb_dev *dev=client->dev, *peer;
+	int retval;
+	if(br->flags & ~USBDRV_SHORT_ZLP || br->reserved)
+		return -EINVAL;
+	/* the peer stays allocated and awake for as long as we feed it */
+	peer=usbdrv_dev_get(br->minor);
+	if(IS_ERR(peer))
+		return PTR_ERR(peer);
+	retval=down_write_killable(&dev->io_rwsem);
+	if(retval)
+		goto put;
+	if(dev->gone){
+		retval=-ENODEV;
+		goto unlock;
+	}
+	if(dev->bridge_peer){
+		retval=-EBUSY;
+		goto unlock;
+	}
+	retval=usbdrv_pm_get(peer);
+	if(retval)
+		goto unlock;
+	dev->bridge_peer=peer;
+	dev->bridge_flags=br->flags;
+	spin_lock_irq(&dev->rx_lock);
+	dev->bridging=true;
+	spin_unlock_irq(&dev->rx_lock);
+	retval=usbdrv_rx_set_stream(dev,true);
+	if(retval){
+		spin_lock_irq(&dev->rx_lock);
+		dev->bridging=false;
+		spin_unlock_irq(&dev->rx_lock);
+		dev->bridge_peer=NULL;
+		usbdrv_pm_put(peer);
+		goto unlock;
+	}
+	client->bridging=true;
+	mutex_lock(&peer->park_mutex);
+	list_add_tail(&dev->bridge_node,&peer->bridge_srcs);
+	mutex_unlock(&peer->park_mutex);
+	up_write(&dev->io_rwsem);
+	return 0;
+unlock:
+	up_write(&dev->io_rwsem);
+put:
+	kref_put(&peer->kref,usb_delete);
+	return retval;
+}
+
+static int usbdrv_bridge_stop(struct usb_client *client){
+	struct usb_dev *dev=client->dev, *peer;
+	struct usb_rxbuf *rxb, *tmp;
+	if(!client->bridging)
+		return -EINVAL;
+	down_write(&dev->io_rwsem);
+	peer=dev->bridge_peer;
+	mutex_lock(&peer->park_mutex);
+	list_del(&dev->bridge_node);
+	mutex_unlock(&peer->park_mutex);
+	spin_lock_irq(&dev->rx_lock);
+	dev->bridging=false;
+	spin_unlock_irq(&dev->rx_lock);
+	usbdrv_rx_set_stream(dev,false);
+	/* buffers on their way out come back through the completion handler */
+	usb_kill_anchored_urbs(&dev->bridge_anchor);
+	/* and those a suspended peer held back are dropped */
+	spin_lock_irq(&dev->rx_lock);
+	list_for_each_entry_safe(rxb,tmp,&dev->bridge_parked,node){
+		list_move_tail(&rxb->node,&dev->rx_free);
+		dev->rx_nfree++;
+	}
+	spin_unlock_irq(&dev->rx_lock);
+	dev->bridge_peer=NULL;
+	client->bridging=false;
+	up_write(&dev->io_rwsem);
+	/* a clear-halt we asked of a peer unplugged meanwhile must not outlive it */
+	flush_delayed_work(&peer->recover_work);
+	usbdrv_pm_put(peer);
+	kref_put(&peer->kref,usb_delete);
+	return 0;
+}
+
+/*
+ * Take the oldest completed receive buffer off rx_ready, waiting for one if
+ * need be.  The buffer is the caller's until recycled or unclaimed, so
+ * concurrent readers copy out of different buffers with rx_lock dropped.
+ * Streaming keeps the pool armed and readers only drain rx_ready; otherwise
+ * each waiting reader arms one buffer sized for itself, so the transfers of
+ * concurrent readers overlap.  Data from a transfer that outlived its read's
+ * timeout stays queued for the next read instead of being thrown away.
+ */
+static struct usb_rxbuf *usbdrv_rx_claim(struct usb_dev *dev, struct usb_client *client, size_t count, bool nonblock){
+	unsigned int timeout_ms=client->params.read_timeout_ms;
+	long left=timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+	struct usb_rxbuf *rxb;
+	size_t len;
+	int retval;
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_readers++;
+	for(;;){
+		if(dev->gone){
+			rxb=ERR_PTR(-ENODEV);
+			break;
+		}
+		rxb=list_first_entry_or_null(&dev->rx_ready,struct usb_rxbuf,node);
+		if(rxb){
+			list_del(&rxb->node);
+			dev->rx_nready--;
+			break;
+		}
+		if(dev->rx_armed < dev->rx_readers && !dev->rx_halted && dev->rx_nfree){
+			/*
+			 * whole packets only, or a full packet from the device would
+			 * overflow the urb; a short read still asks for one packet and
+			 * leaves the rest in the buffer for the next read
+			 */
+			len=min_t(size_t,count,client->params.transfer_size);
+			len=max_t(size_t,len,dev->bulk_in_size);
+			len=min_t(size_t,len,dev->rx_buf_size);
+			len-=len % dev->bulk_in_size;
+			retval=usbdrv_rx_submit(dev,len,(client->params.short_policy & USBDRV_SHORT_NOT_OK) ? URB_SHORT_NOT_OK : 0);
+			if(retval){
+				rxb=ERR_PTR(dev->gone ? -ENODEV : retval);
+				break;
+			}
+		}
+		if(nonblock){
+			rxb=ERR_PTR(-EAGAIN);
+			break;
+		}
+		spin_unlock_irq(&dev->rx_lock);
+		/* also wake when recovery swallowed a transfer or a buffer came free, to start another */
+		left=wait_event_interruptible_timeout(dev->rx_wait,READ_ONCE(dev->rx_nready) || dev->gone ||
+						      (READ_ONCE(dev->rx_armed) < READ_ONCE(dev->rx_readers) &&
+						       READ_ONCE(dev->rx_nfree) && !READ_ONCE(dev->rx_halted)),left);
+		spin_lock_irq(&dev->rx_lock);
+		if(left <= 0){
+			rxb=ERR_PTR(left ? -ERESTARTSYS : -ETIMEDOUT);
+			break;
+		}
+	}
+	dev->rx_readers--;
+	spin_unlock_irq(&dev->rx_lock);
+	return rxb;
+}
+
+/* Buffered read through the receive pool */
+static ssize_t usbdrv_read_pool(struct usb_dev *dev, struct usb_client *client, char __user *buffer,
+				size_t count, bool nonblock){
+	struct usb_rxbuf *rxb;
+	size_t chunk;
+	int retval;
+	rxb=usbdrv_rx_claim(dev,client,count,nonblock);
+	if(IS_ERR(rxb))
+		return PTR_ERR(rxb);
+	if(rxb->status && !usbdrv_unlink_status(rxb->status)){
+		/* any error is reported once; keep -EPIPE so userspace sees a stall */
+		retval=rxb->status;
+		usbdrv_rx_recycle(dev,rxb);
+		return (retval == -EPIPE || retval == -EREMOTEIO) ? retval : -EIO;
+	}
+	chunk=min_t(size_t,count,rxb->len - rxb->off);
+	if(copy_to_user(buffer,rxb->data + rxb->off,chunk)){  //  On success, this will be zero.
+		usbdrv_rx_unclaim(dev,rxb);
+		return -EFAULT;
+	}
+	rxb->off+=chunk;
+	if(rxb->off == rxb->len)
+		usbdrv_rx_recycle(dev,rxb);
+	else
+		usbdrv_rx_unclaim(dev,rxb);
+	return chunk;
+}
+
+static ssize_t usb_read(struct file *filep,char __user *buffer,size_t count,loff_t *offset){
+	int retval=0;
+	struct usb_client *client;
+	struct usb_dev *dev;
+	size_t len;
+	bool idle;
+	client=(struct usb_client *)filep->private_data;
+	if(client == NULL)
+		return -ENODEV;
+	dev=client->dev;
+	if(!count)
+		return 0;
+	/* readers run side by side, each claims whole receive buffers */
+	retval=down_read_interruptible(&dev->io_rwsem);
+	if(retval)
+		return retval;
+	if(dev->gone){
+		retval=-ENODEV;
+		goto exit;
+	}
+	/* a bridge owns the bulk-in data */
+	if(dev->bridge_peer){
+		retval=-EBUSY;
+		goto exit;
+	}
+	retval=usbdrv_pm_get(dev);
+	if(retval)
+		goto exit;
+	/*
+	 * big reads bypass the receive pool when the controller allows, unless it
+	 * holds data; the direct path always waits, so not for O_NONBLOCK
+	 */
+	spin_lock_irq(&dev->rx_lock);
+	idle=!dev->rx_armed && !dev->rx_nready && !dev->rx_filter && !atomic_read(&dev->crc_rx_users);
+	spin_unlock_irq(&dev->rx_lock);
+	len=(idle && !(filep->f_flags & O_NONBLOCK)) ? usbdrv_direct_len(dev,buffer,count) : 0;
+	if(len)
+		retval=usbdrv_read_direct(dev,client,buffer,len);
+	else
+		retval=usbdrv_read_pool(dev,client,buffer,count,filep->f_flags & O_NONBLOCK);
+	usbdrv_pm_put(dev);
+exit:
+	up_read(&dev->io_rwsem);
+	return retval;
+}
+
+/*
+ * May @req go to the host controller now?  Each priority class has its own
+ * urb slots, so urgent writes never wait for a bulk slot.  Bulk writes are
+ * further held back while bulk_inflight_kb of bulk data is already on the
+ * wire: the controller runs urbs on one endpoint in order, so that limit is
+ * what bounds the latency of an urgent write.  A single write larger than the
+ * limit may still go out once nothing else is in flight.
+ */
+static bool usbdrv_write_may_submit(struct usb_dev *dev, struct usb_wreq *req){
+	if(dev->wq_inflight[req->prio] >= writes_in_flight)
+		return false;
+	if(req->prio == USBDRV_PRIO_BULK && dev->bulk_inflight &&
+	   dev->bulk_inflight + req->len > (size_t)bulk_inflight_kb * 1024)
+		return false;
+	return true;
+}
+
+/*
+ * Take @len bytes worth of tokens from the pacing bucket.  A write larger
+ * than the bucket goes out once the bucket is full and leaves it in debt,
+ * so the average rate holds for any write size.  When the tokens are not
+ * there yet the pace timer is armed for the moment they will be.
+ * Called with dev->lock held.
+ */
+static bool usbdrv_pace_take(struct usb_dev *dev, size_t len){
+	ktime_t now;
+	s64 need;
+	u64 wait_ns;
+	if(!dev->pace_rate)
+		return true;
+	now=ktime_get();
+	need=min_t(s64,len,dev->pace_burst);
+	dev->pace_tokens+=mul_u64_u64_div_u64(ktime_to_ns(ktime_sub(now,dev->pace_stamp)),dev->pace_rate,NSEC_PER_SEC);
+	dev->pace_tokens=min_t(s64,dev->pace_tokens,dev->pace_burst);
+	dev->pace_stamp=now;
+	if(dev->pace_tokens >= need){
+		dev->pace_tokens-=len;
+		if(dev->pace_since){
+			usbdrv_stat_add(dev,USBDRV_STAT_PACED_NS,ktime_to_ns(ktime_sub(now,dev->pace_since)));
+			dev->pace_since=0;
+		}
+		return true;
+	}
+	if(!dev->pace_since){
+		dev->pace_since=now;
+		usbdrv_stat_add(dev,USBDRV_STAT_PACED,1);
+	}
+	wait_ns=DIV_ROUND_UP_ULL((u64)(need-dev->pace_tokens)*NSEC_PER_SEC,dev->pace_rate);
+	if(!hrtimer_is_queued(&dev->pace_timer))
+		hrtimer_start(&dev->pace_timer,ns_to_ktime(wait_ns),HRTIMER_MODE_REL_SOFT);
+	return false;
+}
+
+/* Release the buffers of a write that is not (or no longer) on the wire */
+static void usbdrv_wreq_free(struct usb_wreq *req){
+	struct urb *urb=req->urb;
+	usb_free_coherent(urb->dev,urb->transfer_buffer_length,urb->transfer_buffer,urb->transfer_dma);
+	usbdrv_urb_put(req->dev,urb);
+	usbdrv_pm_put(req->dev);
+	atomic_dec(&req->client->wq_count);
+	kref_put(&req->client->ref,usbdrv_client_free);
+	kfree(req);
+}
+
+static void usbdrv_async_done(struct usb_client *client, struct usb_async *async, int status, u32 actual_length);
+
+/* Bytes of the caller's data that went out; our CRC trailer is not theirs */
+static u32 usbdrv_wreq_actual(struct usb_wreq *req){
+	return min_t(u32,req->urb->actual_length,req->len - req->trailer);
+}
+
+/* Hand a finished write back: a synchronous writer frees it, otherwise we do */
+static void usbdrv_wreq_finish(struct usb_wreq *req){
+	if(req->sync){
+		complete(&req->done);
+		return;
+	}
+	if(req->async)
+		usbdrv_async_done(req->client,req->async,req->status,usbdrv_wreq_actual(req));
+	usbdrv_wreq_free(req);
+}
+
+/* Finish the writes usbdrv_write_kick() failed, once dev->lock is dropped */
+static void usbdrv_wreq_finish_list(struct list_head *list){
+	struct usb_wreq *req, *tmp;
+	list_for_each_entry_safe(req,tmp,list,node){
+		list_del(&req->node);
+		usbdrv_wreq_finish(req);
+	}
+}
+
+/*
+ * Move queued writes to the host controller, highest priority class first.
+ * Called with dev->lock held, from both write() and the completion handler.
+ * Writes the controller refused go on @failed; freeing their buffers can't
+ * be done with interrupts off, so the caller hands them to
+ * usbdrv_wreq_finish_list() after unlocking.
+ */
+static void usbdrv_write_kick(struct usb_dev *dev, struct list_head *failed){
+	struct usb_wreq *req;
+	int prio, retval;
+	if(dev->gone || dev->wq_halted)
+		return;
+	for(prio=USBDRV_NR_PRIO-1; prio>=0; --prio){
+		while(!list_empty(&dev->wq[prio])){
+			req=list_first_entry(&dev->wq[prio],struct usb_wreq,node);
+			if(!usbdrv_write_may_submit(dev,req))
+				break;
+			/* pacing is per device, so running out of tokens stops every class */
+			if(!usbdrv_pace_take(dev,req->len))
+				return;
+			list_del(&req->node);
+			usb_anchor_urb(req->urb,&dev->submitted);
+			retval=usb_submit_urb(req->urb,GFP_ATOMIC);
+			if(retval){
+				pr_err("%s: failed submitting write urb, error %d",__func__,retval);
+				usb_unanchor_urb(req->urb);
+				if(!req->sync && !req->async)
+					dev->errors=retval;
+				atomic_dec(&dev->wq_count[prio]);
+				req->state=USBDRV_WREQ_DONE;
+				req->status=retval;
+				list_add_tail(&req->node,failed);
+				wake_up_interruptible(&dev->wq_wait);
+				continue;
+			}
+			if(req->retries)
+				usbdrv_stat_add(dev,USBDRV_STAT_RESUBMITS,1);
+			req->state=USBDRV_WREQ_SUBMITTED;
+			dev->wq_inflight[prio]++;
+			if(prio == USBDRV_PRIO_BULK)
+				dev->bulk_inflight+=req->len;
+		}
+	}
+}
+
+static enum hrtimer_restart usbdrv_pace_timer(struct hrtimer *timer){
+	struct usb_dev *dev=container_of(timer,struct usb_dev,pace_timer);
+	unsigned long flags;
+	LIST_HEAD(failed);
+	spin_lock_irqsave(&dev->lock,flags);
+	usbdrv_write_kick(dev,&failed);
+	spin_unlock_irqrestore(&dev->lock,flags);
+	usbdrv_wreq_finish_list(&failed);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Restart both queues once recovery or a reset is over.  Writes that failed
+ * go back in front of their class in their original order.
+ */
+static void usbdrv_restart_queues(struct usb_dev *dev){
+	LIST_HEAD(failed);
+	int prio;
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_halted=false;
+	usbdrv_rx_fill(dev);
+	spin_unlock_irq(&dev->rx_lock);
+	wake_up_interruptible(&dev->rx_wait);
+	spin_lock_irq(&dev->lock);
+	dev->wq_halted=false;
+	for(prio=0; prio < USBDRV_NR_PRIO; ++prio)
+		list_splice_init(&dev->wq_retry[prio],&dev->wq[prio]);
+	usbdrv_write_kick(dev,&failed);
+	spin_unlock_irq(&dev->lock);
+	usbdrv_wreq_finish_list(&failed);
+	wake_up_interruptible(&dev->wq_wait);
+}
+
+static int usbdrv_clear_halt(struct usb_dev *dev, unsigned int pipe){
+	int retval=usb_clear_halt(dev->udev,pipe);
+	if(retval)
+		dev_warn_ratelimited(&dev->interface->dev,"clear-halt of ep %02x failed: %d\n",usb_pipeendpoint(pipe),retval);
+	else
+		usbdrv_stat_add(dev,USBDRV_STAT_CLEAR_HALTS,1);
+	return retval;
+}
+
+/*
+ * Recovery worker: clear halted endpoints and resubmit.  If the device
+ * won't even take a clear-halt, reset it; pre_reset/post_reset carry the
+ * queues across.
+ */
+static void usbdrv_recover_work(struct work_struct *work){
+	struct usb_dev *dev=container_of(to_delayed_work(work),struct usb_dev,recover_work);
+	int retval=0, err;
+	if(dev->gone || dev->resetting || dev->suspended)
+		return;
+	/*
+	 * usb_clear_halt() wants nothing queued on the endpoint.  Receive
+	 * buffers armed behind a stall never got data; writes behind one are
+	 * parked, in order, to follow the one that failed.
+	 */
+	if(test_and_clear_bit(USBDRV_HALT_IN,&dev->recover_flags)){
+		spin_lock_irq(&dev->rx_lock);
+		dev->rx_halted=true;
+		spin_unlock_irq(&dev->rx_lock);
+		usb_kill_anchored_urbs(&dev->rx_anchor);
+		retval=usbdrv_clear_halt(dev,usb_rcvbulkpipe(dev->udev,dev->bulk_in_endpointAddr));
+	}
+	if(test_and_clear_bit(USBDRV_HALT_OUT,&dev->recover_flags)){
+		spin_lock_irq(&dev->lock);
+		dev->wq_halted=true;
+		spin_unlock_irq(&dev->lock);
+		usb_kill_anchored_urbs(&dev->submitted);
+		/* errnos don't combine; the first one decides */
+		err=usbdrv_clear_halt(dev,usb_sndbulkpipe(dev->udev,dev->bulk_out_endpointAddr));
+		if(!retval)
+			retval=err;
+	}
+	if(retval && retval != -ENODEV){
+		usb_queue_reset_device(dev->interface);
+		return;
+	}
+	usbdrv_restart_queues(dev);
+}
+
+/*
+ * Keep @req for resubmission once the queue restarts.  Transfers killed to
+ * empty the endpoint complete newest first, so @req goes in by queueing
+ * order rather than at the tail.  Called with dev->lock held.
+ */
+static void usbdrv_wreq_park(struct usb_dev *dev, struct usb_wreq *req){
+	struct usb_wreq *pos;
+	list_for_each_entry_reverse(pos,&dev->wq_retry[req->prio],node)
+		if(pos->seq < req->seq)
+			break;
+	req->state=USBDRV_WREQ_QUEUED;
+	list_add(&req->node,&pos->node);
+}
+
+/* (in) completion routine */
+/*
+ *   - Out of memory (-ENOMEM)
+ *   - Unplugged device (-ENODEV)
+ *   - Stalled endpoint (-EPIPE)
+ *   - Too many queued ISO transfers (-EAGAIN)
+ *   - Too many requested ISO frames (-EFBIG)
+ *   - Invalid INT interval (-EINVAL)
+ *   - More than one packet for INT (-EINVAL)
+ */
+static void usb_write_bulk_callback(struct urb *urb){
+	struct usb_wreq *req=urb->context;
+	struct usb_dev *dev=req->dev;
+	unsigned long flags;
+	LIST_HEAD(failed);
+	spin_lock_irqsave(&dev->lock,flags);
+	dev->wq_inflight[req->prio]--;
+	if(req->prio == USBDRV_PRIO_BULK)
+		dev->bulk_inflight-=req->len;
+	if(urb->actual_length)
+		usbdrv_pm_first_byte(dev);
+	if(!urb->status){
+		usbdrv_recover_reset_backoff(dev);
+	}else if(!dev->gone && !req->cancel &&
+		 ((usbdrv_recoverable(urb->status) && req->retries < recover_retries) ||
+		  ((dev->resetting || dev->suspended || dev->wq_halted) && usbdrv_unlink_status(urb->status)))){
+		/*
+		 * Resubmit once recovered: the write that failed, and those we
+		 * killed behind it while the queue is held.
+		 */
+		if(usbdrv_recoverable(urb->status)){
+			req->retries++;
+			usbdrv_recover_schedule(dev,urb->status,USBDRV_HALT_OUT);
+		}
+		dev->wq_halted=true;
+		usbdrv_wreq_park(dev,req);
+		spin_unlock_irqrestore(&dev->lock,flags);
+		return;
+	}
+	if(usbdrv_recoverable(urb->status))
+		usbdrv_stat_add(dev,USBDRV_STAT_RECOVERY_GIVEUPS,1);
+	/* sync and submitted writes get their own status, everybody else the next write() */
+	if(!req->sync && !req->async && urb->status && !usbdrv_unlink_status(urb->status))
+		dev->errors=urb->status;
+	req->status=urb->status;
+	req->state=USBDRV_WREQ_DONE;
+	atomic_dec(&dev->wq_count[req->prio]);
+	/* the slot we just freed may let the next queued write go */
+	usbdrv_write_kick(dev,&failed);
+	spin_unlock_irqrestore(&dev->lock,flags);
+	wake_up_interruptible(&dev->wq_wait);
+	/* free up our allocated buffer */
+	usbdrv_wreq_finish(req);
+	usbdrv_wreq_finish_list(&failed);
+}
+
+/* Raise @count by one unless it has reached @limit */
+static bool usbdrv_count_take(atomic_t *count, unsigned int limit){
+	int old=atomic_read(count);
+	do{
+		if(old >= (int)limit)
+			return false;
+	}while(!atomic_try_cmpxchg(count,&old,old + 1));
+	return true;
+}
+
+/*
+ * Reserve a place in the write queue for a write on @client, sleeping until
+ * there is one unless @nonblock.  Both the device's per-class limit and the
+ * fd's queue_depth apply.  The reservation is dropped when the write is freed.
+ * It takes no lock, so writers on many threads only meet in dev->lock for
+ * the moment it takes to link their request.  Returns the priority class
+ * the place was taken in, which the write has to be queued and unreserved
+ * in even if USBDRV_IOC_SET_PRIO changes the fd's class meanwhile.
+ */
+static int usbdrv_write_reserve(struct usb_dev *dev, struct usb_client *client, bool nonblock){
+	int prio=READ_ONCE(client->params.prio);
+	unsigned int depth=client->params.queue_depth;
+	unsigned int timeout_ms=client->params.write_timeout_ms;
+	long left=timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+	int errors;
+	for(;;){
+		if(READ_ONCE(dev->gone))
+			return -ENODEV;
+		/* any error is reported once; keep -EPIPE so userspace sees a stall */
+		errors=READ_ONCE(dev->errors) ? xchg(&dev->errors,0) : 0;
+		if(errors)
+			return errors == -EPIPE ? -EPIPE : -EIO;
+		if(usbdrv_count_take(&dev->wq_count[prio],writes_queued)){
+			if(usbdrv_count_take(&client->wq_count,depth))
+				return prio;
+			atomic_dec(&dev->wq_count[prio]);
+			wake_up_interruptible(&dev->wq_wait);
+		}
+		if(nonblock)
+			return -EAGAIN;
+		left=wait_event_interruptible_timeout(dev->wq_wait,READ_ONCE(dev->gone) || READ_ONCE(dev->errors) ||
+						      (atomic_read(&dev->wq_count[prio]) < writes_queued &&
+						       atomic_read(&client->wq_count) < depth),left);
+		if(left < 0)
+			return -ERESTARTSYS;
+		if(!left)
+			return -ETIMEDOUT;
+	}
+}
+
+static void usbdrv_write_unreserve(struct usb_dev *dev, struct usb_client *client, int prio){
+	atomic_dec(&dev->wq_count[prio]);
+	atomic_dec(&client->wq_count);
+	wake_up_interruptible(&dev->wq_wait);
+}
+
+/*
+ * Take a synchronous write back from the queue after its writer gave up
+ * waiting.  On return the completion handler is done with @req.
+ */
+static void usbdrv_write_cancel(struct usb_dev *dev, struct usb_wreq *req){
+	unsigned long flags;
+	bool queued;
+	spin_lock_irqsave(&dev->lock,flags);
+	queued=req->state == USBDRV_WREQ_QUEUED;
+	if(queued){
+		list_del(&req->node);
+		atomic_dec(&dev->wq_count[req->prio]);
+		req->state=USBDRV_WREQ_DONE;
+		req->status=-ECONNRESET;
+	}else{
+		/* killed below; it must complete rather than wait for a restart */
+		req->cancel=true;
+	}
+	spin_unlock_irqrestore(&dev->lock,flags);
+	if(queued){
+		wake_up_interruptible(&dev->wq_wait);
+		return;
+	}
+	usb_kill_urb(req->urb);
+	wait_for_completion(&req->done);
+}
+
+/* Wait for a USBDRV_IO_SYNC write and turn its outcome into write()'s return */
+static ssize_t usbdrv_write_wait(struct usb_dev *dev, struct usb_wreq *req, unsigned int timeout_ms){
+	ssize_t retval;
+	long left;
+	left=wait_for_completion_interruptible_timeout(&req->done,timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT);
+	if(left <= 0)
+		usbdrv_write_cancel(dev,req);
+	if(!req->status)
+		retval=usbdrv_wreq_actual(req);
+	else if(left < 0)
+		retval=-ERESTARTSYS;
+	else if(!left)
+		retval=-ETIMEDOUT;
+	else if(req->status == -EPIPE || req->status == -ENODEV)
+		retval=req->status;
+	else
+		retval=-EIO;
+	usbdrv_wreq_free(req);
+	return retval;
+}
+
+/*
+ * Copy @len bytes from userspace into a new write request of @client and put
+ * it on the write queue at @prio.  The caller holds a reservation in @prio
+ * from usbdrv_write_reserve(), which the request takes over.  A USBDRV_IO_SYNC
+ * request is returned through @reqp for usbdrv_write_wait(); an @async one
+ * reports to the client's completion list instead.
+ */
+static int usbdrv_write_queue(struct usb_dev *dev, struct usb_client *client, int prio, const char __user *buffer,
+			      size_t len, unsigned int short_policy, bool sync, struct usb_async *async,
+			      struct usb_wreq **reqp){
+	struct usb_wreq *req=NULL;
+	struct urb *urb=NULL;  /* struct urb - USB Request Block*/
+	char *buf = NULL;
+	unsigned long flags;
+	LIST_HEAD(failed);
+	bool crc=client->params.crc_flags & USBDRV_CRC_APPEND_TX;
+	size_t wire_len=crc ? len + USBDRV_CRC_SIZE : len;
+	int retval;
+	/* resume the device if needed; the request keeps it awake until freed */
+	retval=usbdrv_pm_get_io(dev);
+	if(retval){
+		usbdrv_write_unreserve(dev,client,prio);
+		return retval;
+	}
+	req=kzalloc(sizeof(*req),GFP_KERNEL);
+	if(!req){
+		retval = -ENOMEM;
+		goto error;
+	}
+	/* create a urb, and a buffer for it, and copy the data to the urb.URBs are taken from the device's pool*/
+	urb=usbdrv_urb_get(dev,GFP_KERNEL);  /* If the return value is NULL, some error occurred within the USB core*/
+	if(!urb){
+		retval = -ENOMEM;
+		goto error;
+	}
+	/*usb_buffer_alloc() is renamed to usb_alloc_coherent(), allocate dma-consistent buffer for URB_NO_xxx_DMA_MAP*/
+	buf=usb_alloc_coherent(dev->udev,wire_len,GFP_KERNEL,&urb->transfer_dma);/*dma_addr_t transfer_dma;  (in) dma addr for transfer_buffer */
+	if (!buf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+	if (copy_from_user(buf, buffer, len)) {
+		retval = -EFAULT;
+		goto error;
+	}
+	/* the trailer is computed right after the copy, while the data is in cache */
+	if(crc){
+		put_unaligned_le32(usbdrv_crc(dev,buf,len),buf + len);
+		usbdrv_stat_add(dev,USBDRV_STAT_CRC_TX,1);
+	}
+	/**
+	 * usb_fill_bulk_urb - macro to help initialize a bulk urb
+	 * @urb: pointer to the urb to initialize.
+	 * @dev: pointer to the struct usb_device for this urb.
+	 * @pipe: the endpoint pipe  : usb_sndbulkpipe(dev, endpoint)
+	 * @transfer_buffer: pointer to the transfer buffer
+	 * @buffer_length: length of the transfer buffer
+	 * @complete_fn: pointer to the usb_complete_t function
+	 * @context: what to set the urb context to.
+	 *
+	 * Initializes a bulk urb with the proper information needed to submit it
+	 * to a device.
+	 */
+	usb_fill_bulk_urb(urb,dev->udev,usb_sndbulkpipe(dev->udev,dev->bulk_out_endpointAddr),buf,wire_len,usb_write_bulk_callback,req);
+	/*set URB_NO_TRANSFER_DMA_MAP so that usbcore won't map or unmap the buffer.*/
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	if(short_policy & USBDRV_SHORT_ZLP)
+		urb->transfer_flags |= URB_ZERO_PACKET;
+	req->dev=dev;
+	req->client=client;
+	req->urb=urb;
+	req->len=wire_len;
+	req->trailer=wire_len - len;
+	req->prio=prio;
+	req->sync=sync;
+	req->async=async;
+	req->state=USBDRV_WREQ_QUEUED;
+	init_completion(&req->done);
+	/* the request holds the client until it is freed, even past close() */
+	kref_get(&client->ref);
+	/* queue it; the urb is sent out the bulk port as soon as its class may submit */
+	spin_lock_irqsave(&dev->lock,flags);
+	if(dev->gone){
+		spin_unlock_irqrestore(&dev->lock,flags);
+		kref_put(&client->ref,usbdrv_client_free);
+		retval=-ENODEV;
+		goto error;
+	}
+	req->seq=dev->wq_seq++;
+	list_add_tail(&req->node,&dev->wq[prio]);
+	usbdrv_write_kick(dev,&failed);
+	spin_unlock_irqrestore(&dev->lock,flags);
+	usbdrv_wreq_finish_list(&failed);
+	usbdrv_stat_add(dev,prio == USBDRV_PRIO_HIGH ? USBDRV_STAT_WRITES_HIGH : USBDRV_STAT_WRITES_BULK,1);
+	usbdrv_stat_add(dev,USBDRV_STAT_WRITE_BYTES,len);
+	if(reqp)
+		*reqp=req;
+	return 0;
+error:
+	if(buf)
+		usb_free_coherent(dev->udev,wire_len,buf,urb->transfer_dma);
+	if(urb)
+		usbdrv_urb_put(dev,urb);
+	kfree(req);
+	usbdrv_pm_put(dev);
+	usbdrv_write_unreserve(dev,client,prio);
+	return retval;
+}
+
+static ssize_t usb_write(struct file *filep, const char __user *buffer, size_t count, loff_t *offset){
+	struct usb_client *client;
+	struct usb_dev *dev;
+	struct usb_wreq *req;
+	size_t writesize;
+	bool sync;
+	int prio, retval;
+	client=(struct usb_client *)filep->private_data;
+	dev=client->dev;
+	sync=client->params.io_mode == USBDRV_IO_SYNC;
+	writesize=min_t(size_t,count,client->params.transfer_size);
+	/* verify that we actually have some data to write */
+	if (count == 0)
+		return 0;
+	/* limit the number of queued writes to stop a user from using up all RAM */
+	prio=usbdrv_write_reserve(dev,client,filep->f_flags & O_NONBLOCK);
+	if(prio < 0)
+		return prio;
+	retval=usbdrv_write_queue(dev,client,prio,buffer,writesize,client->params.short_policy,sync,NULL,&req);
+	if(retval)
+		return retval;
+	if(sync)
+		return usbdrv_write_wait(dev,req,client->params.write_timeout_ms);
+	return writesize;
+}
+
+/* Post the outcome of a submitted transfer for USBDRV_IOC_REAP */
+static void usbdrv_async_done(struct usb_client *client, struct usb_async *async, int status, u32 actual_length){
+	unsigned long flags;
+	async->status=status;
+	async->actual_length=actual_length;
+	async->timestamp_ns=ktime_get_ns();
+	spin_lock_irqsave(&client->async_lock,flags);
+	list_add_tail(&async->node,&client->async_done);
+	spin_unlock_irqrestore(&client->async_lock,flags);
+	wake_up_interruptible(&client->async_wait);
+}
+
+/* Free a reaped (or never reaped) transfer */
+static void usbdrv_async_free(struct usb_dev *dev, struct usb_async *async){
+	struct urb *urb=async->urb;
+	if(urb){
+		usb_free_coherent(dev->udev,urb->transfer_buffer_length,urb->transfer_buffer,urb->transfer_dma);
+		usbdrv_urb_put(dev,urb);
+	}
+	kfree(async);
+}
+
+/*
+ * Submit an IN transfer, or while the device is suspended park it on
+ * async_parked in submission order for usb_resume().  Called with dev->lock
+ * held, which keeps suspend and resume from coming in between.
+ */
+static int usbdrv_async_start(struct usb_dev *dev, struct usb_async *async){
+	struct usb_async *pos;
+	int retval;
+	if(dev->suspended){
+		list_for_each_entry_reverse(pos,&dev->async_parked,node)
+			if(pos->seq < async->seq)
+				break;
+		list_add(&async->node,&pos->node);
+		return 0;
+	}
+	async->gen=dev->suspend_gen;
+	usb_anchor_urb(async->urb,&async->client->async_anchor);
+	retval=usb_submit_urb(async->urb,GFP_ATOMIC);
+	if(retval)
+		usb_unanchor_urb(async->urb);
+	return retval;
+}
+
+static void usbdrv_async_in_callback(struct urb *urb){
+	struct usb_async *async=urb->context;
+	struct usb_dev *dev=async->client->dev;
+	unsigned long flags;
+	int status=urb->status;
+	if(usbdrv_parked(dev,async->gen,status,urb->actual_length)){
+		/* stopped by a suspend: go again, still holding the device */
+		spin_lock_irqsave(&dev->lock,flags);
+		status=usbdrv_async_start(dev,async);
+		spin_unlock_irqrestore(&dev->lock,flags);
+		if(!status)
+			return;
+	}
+	if(urb->actual_length)
+		usbdrv_pm_first_byte(dev);
+	/* the stall is reported with the transfer; clear it for the next one */
+	if(status == -EPIPE && !dev->gone)
+		usbdrv_recover_schedule(dev,status,USBDRV_HALT_IN);
+	usbdrv_async_done(async->client,async,status,urb->actual_length);
+	usbdrv_pm_put(dev);
+}
+
+/* Fail the IN transfers of @client that a suspend parked; it is going away */
+static void usbdrv_async_unpark(struct usb_dev *dev, struct usb_client *client){
+	struct usb_async *async, *tmp;
+	LIST_HEAD(parked);
+	spin_lock_irq(&dev->lock);
+	list_for_each_entry_safe(async,tmp,&dev->async_parked,node)
+		if(async->client == client)
+			list_move_tail(&async->node,&parked);
+	spin_unlock_irq(&dev->lock);
+	list_for_each_entry_safe(async,tmp,&parked,node){
+		list_del(&async->node);
+		usbdrv_async_done(client,async,-ENOENT,0);
+		usbdrv_pm_put(dev);
+	}
+}
+
+static int usbdrv_async_submit_in(struct usb_dev *dev, struct usb_client *client, struct usb_async *async,
+				  const struct usbdrv_xfer *xfer){
+	struct urb *urb;
+	void *buf;
+	int retval;
+	urb=usbdrv_urb_get(dev,GFP_KERNEL);
+	if(!urb)
+		return -ENOMEM;
+	buf=usb_alloc_coherent(dev->udev,xfer->length,GFP_KERNEL,&urb->transfer_dma);
+	if(!buf){
+		usbdrv_urb_put(dev,urb);
+		return -ENOMEM;
+	}
+	/* dropped by the completion handler */
+	retval=usbdrv_pm_get_io(dev);
+	if(retval){
+		usb_free_coherent(dev->udev,xfer->length,buf,urb->transfer_dma);
+		usbdrv_urb_put(dev,urb);
+		return retval;
+	}
+	usb_fill_bulk_urb(urb,dev->udev,usb_rcvbulkpipe(dev->udev,dev->bulk_in_endpointAddr),buf,xfer->length,usbdrv_async_in_callback,async);
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	if(xfer->flags & USBDRV_SHORT_NOT_OK)
+		urb->transfer_flags |= URB_SHORT_NOT_OK;
+	async->urb=urb;
+	spin_lock_irq(&dev->lock);
+	async->seq=dev->wq_seq++;
+	retval=usbdrv_async_start(dev,async);
+	spin_unlock_irq(&dev->lock);
+	if(retval){
+		usbdrv_pm_put(dev);
+		usb_free_coherent(dev->udev,xfer->length,buf,urb->transfer_dma);
+		usbdrv_urb_put(dev,urb);
+		async->urb=NULL;
+	}
+	return retval;
+}
+
+/*
+ * Start one transfer of a USBDRV_IOC_SUBMIT batch.  OUT transfers go through
+ * the write queue, so priority and pacing apply to them as to write().
+ */
+static int usbdrv_async_submit(struct usb_dev *dev, struct usb_client *client, const struct usbdrv_xfer *xfer){
+	struct usb_async *async;
+	int retval;
+	if(!xfer->length || xfer->length > USBDRV_MAX_TRANSFER || xfer->reserved)
+		return -EINVAL;
+	if(xfer->dir > USBDRV_XFER_OUT || xfer->flags & ~(USBDRV_SHORT_NOT_OK | USBDRV_SHORT_ZLP))
+		return -EINVAL;
+	if(dev->gone)
+		return -ENODEV;
+	if(atomic_inc_return(&client->async_pending) > client->params.queue_depth){
+		retval=-EAGAIN;
+		goto error;
+	}
+	async=kzalloc(sizeof(*async),GFP_KERNEL);
+	if(!async){
+		retval=-ENOMEM;
+		goto error;
+	}
+	async->client=client;
+	async->user_data=xfer->user_data;
+	async->buffer=xfer->buffer;
+	async->dir=xfer->dir;
+	if(xfer->dir == USBDRV_XFER_IN){
+		retval=usbdrv_async_submit_in(dev,client,async,xfer);
+	}else{
+		retval=usbdrv_write_reserve(dev,client,true);
+		if(retval >= 0)
+			retval=usbdrv_write_queue(dev,client,retval,u64_to_user_ptr(xfer->buffer),xfer->length,
+						  xfer->flags,false,async,NULL);
+	}
+	if(retval){
+		kfree(async);
+		goto error;
+	}
+	return 0;
+error:
+	atomic_dec(&client->async_pending);
+	return retval;
+}
+
+static long usbdrv_submit(struct usb_dev *dev, struct usb_client *client, struct usbdrv_submit __user *argp){
+	struct usbdrv_submit submit;
+	struct usbdrv_xfer __user *uxfer;
+	struct usbdrv_xfer xfer;
+	__u32 i;
+	int retval=0;
+	if(copy_from_user(&submit,argp,sizeof(submit)))
+		return -EFAULT;
+	uxfer=u64_to_user_ptr(submit.xfers);
+	for(i=0; i < submit.count; ++i){
+		if(copy_from_user(&xfer,&uxfer[i],sizeof(xfer))){
+			retval=-EFAULT;
+			break;
+		}
+		retval=usbdrv_async_submit(dev,client,&xfer);
+		if(retval)
+			break;
+	}
+	if(put_user(i,&argp->submitted))
+		return -EFAULT;
+	/* like io_submit(): a partial batch succeeds, the caller sees how far it got */
+	return i ? 0 : retval;
+}
+
+static bool usbdrv_reap_ready(struct usb_client *client, u32 min_complete){
+	struct usb_async *async;
+	unsigned long flags;
+	u32 n=0;
+	spin_lock_irqsave(&client->async_lock,flags);
+	list_for_each_entry(async,&client->async_done,node)
+		if(++n >= min_complete)
+			break;
+	spin_unlock_irqrestore(&client->async_lock,flags);
+	return n >= min_complete || client->dev->gone;
+}
+
+static long usbdrv_reap(struct usb_dev *dev, struct usb_client *client, struct usbdrv_reap __user *argp){
+	struct usbdrv_reap reap;
+	struct usbdrv_completion __user *ucomp;
+	struct usbdrv_completion comp;
+	struct usb_async *async, *tmp;
+	LIST_HEAD(reaped);
+	unsigned long flags;
+	u32 min_complete;
+	u32 n=0;
+	long left;
+	int retval=0;
+	if(copy_from_user(&reap,argp,sizeof(reap)))
+		return -EFAULT;
+	if(!reap.max || reap.reserved || reap.reserved2)
+		return -EINVAL;
+	min_complete=clamp_t(u32,reap.min_complete,1,reap.max);
+	if(reap.timeout_ms){
+		left=reap.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(reap.timeout_ms);
+		left=wait_event_interruptible_timeout(client->async_wait,usbdrv_reap_ready(client,min_complete),left);
+		if(left < 0)
+			return -ERESTARTSYS;
+	}
+	spin_lock_irqsave(&client->async_lock,flags);
+	list_for_each_entry_safe(async,tmp,&client->async_done,node){
+		if(n == reap.max)
+			break;
+		list_move_tail(&async->node,&reaped);
+		n++;
+	}
+	spin_unlock_irqrestore(&client->async_lock,flags);
+	ucomp=u64_to_user_ptr(reap.completions);
+	n=0;
+	list_for_each_entry_safe(async,tmp,&reaped,node){
+		memset(&comp,0,sizeof(comp));
+		comp.user_data=async->user_data;
+		comp.status=async->status;
+		comp.actual_length=async->actual_length;
+		comp.timestamp_ns=async->timestamp_ns;
+		if(async->dir == USBDRV_XFER_IN && async->actual_length &&
+		   copy_to_user(u64_to_user_ptr(async->buffer),async->urb->transfer_buffer,async->actual_length))
+			comp.status=-EFAULT;
+		if(copy_to_user(&ucomp[n],&comp,sizeof(comp))){
+			retval=-EFAULT;
+			break;
+		}
+		n++;
+		list_del(&async->node);
+		usbdrv_async_free(dev,async);
+		atomic_dec(&client->async_pending);
+	}
+	/* what couldn't be reported goes back in front, for the next reap */
+	if(!list_empty(&reaped)){
+		spin_lock_irqsave(&client->async_lock,flags);
+		list_splice(&reaped,&client->async_done);
+		spin_unlock_irqrestore(&client->async_lock,flags);
+	}
+	if(retval && !n)
+		return retval;
+	return put_user(n,&argp->count);
+}
+
+/* Report readiness for epoll: data or completions to collect, room in the write queue */
+static __poll_t usb_poll(struct file *filep, poll_table *wait){
+	struct usb_client *client=(struct usb_client *)filep->private_data;
+	struct usb_dev *dev=client->dev;
+	__poll_t mask=0;
+	int prio=client->params.prio;
+	poll_wait(filep,&client->async_wait,wait);
+	poll_wait(filep,&dev->wq_wait,wait);
+	poll_wait(filep,&dev->rx_wait,wait);
+	if(dev->gone)
+		return EPOLLERR | EPOLLHUP;
+	if(!list_empty(&client->async_done) || READ_ONCE(dev->rx_nready))
+		mask|=EPOLLIN | EPOLLRDNORM;
+	if(atomic_read(&dev->wq_count[prio]) < writes_queued && atomic_read(&client->wq_count) < client->params.queue_depth)
+		mask|=EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+static int usbdrv_set_pacing(struct usb_dev *dev, const struct usbdrv_pacing *pacing){
+	unsigned long flags;
+	ktime_t now;
+	LIST_HEAD(failed);
+	if(pacing->rate && !pacing->burst)
+		return -EINVAL;
+	spin_lock_irqsave(&dev->lock,flags);
+	now=ktime_get();
+	/* a hold under the old settings ends here, or the idle time after it would count too */
+	if(dev->pace_since){
+		usbdrv_stat_add(dev,USBDRV_STAT_PACED_NS,ktime_to_ns(ktime_sub(now,dev->pace_since)));
+		dev->pace_since=0;
+	}
+	dev->pace_rate=pacing->rate;
+	dev->pace_burst=pacing->burst;
+	/* start with a full bucket */
+	dev->pace_tokens=pacing->burst;
+	dev->pace_stamp=now;
+	/* a held queue may go now, or has to wait at the new rate */
+	usbdrv_write_kick(dev,&failed);
+	spin_unlock_irqrestore(&dev->lock,flags);
+	usbdrv_wreq_finish_list(&failed);
+	return 0;
+}
+
+static long usbdrv_get_stats(struct usb_dev *dev, struct usbdrv_stats __user *argp){
+	struct usbdrv_stats *stats;
+	long retval=0;
+	int i;
+	stats=kzalloc(sizeof(*stats),GFP_KERNEL);
+	if(!stats)
+		return -ENOMEM;
+	stats->nr=USBDRV_STAT_NR;
+	for(i=0; i < USBDRV_STAT_NR; ++i)
+		stats->counter[i]=atomic64_read(&dev->stats[i]);
+	if(copy_to_user(argp,stats,sizeof(*stats)))
+		retval=-EFAULT;
+	kfree(stats);
+	return retval;
+}
+
+/*
+ * Batched control transfers, see USBDRV_IOC_CTRL_BATCH.  A window of
+ * requests is kept queued on ep0 so the host controller runs them back to
+ * back; ep0 completes them in order, so results are collected in order too
+ * and the window is a ring of usb_ctrl slots.
+ */
+struct usb_ctrl {
+	struct usb_ctrlrequest setup;	/* DMA'd, so the slots are kmalloc'ed */
+	struct urb *urb;		/* NULL if the transfer never started */
+	void *buf;
+	u64 data;			/* user address of the data stage */
+	bool in;
+	int status;
+	unsigned int gen;		/* dev->suspend_gen when started */
+	struct completion done;
+};
+
+static void usbdrv_ctrl_callback(struct urb *urb){
+	complete(urb->context);
+}
+
+/*
+ * A class or vendor request aimed at an interface or endpoint has to name
+ * ours; the others on the device belong to other drivers.
+ */
+static bool usbdrv_ctrl_ours(struct usb_dev *dev, const struct usbdrv_ctrl_xfer *xfer){
+	u8 index=xfer->wIndex & 0xff;
+	if((xfer->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD)
+		return true;
+	switch(xfer->bRequestType & USB_RECIP_MASK){
+	case USB_RECIP_INTERFACE:
+		return index == dev->interface->cur_altsetting->desc.bInterfaceNumber;
+	case USB_RECIP_ENDPOINT:
+		return index == dev->bulk_in_endpointAddr || index == dev->bulk_out_endpointAddr;
+	default:
+		return true;
+	}
 }
 
-static int usb_open(struct inode *inodep, struct file *filep){
-	struct usb_dev *dev;
-	struct usb_interface *interface;
-	int subminor;
+/* SET_FEATURE(ENDPOINT_HALT) on one of our bulk endpoints, which lets a test provoke stall recovery */
+static bool usbdrv_ctrl_halt(struct usb_dev *dev, const struct usbdrv_ctrl_xfer *xfer){
+	u8 index=xfer->wIndex & 0xff;
+	return xfer->bRequestType == (USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT) &&
+	       xfer->bRequest == USB_REQ_SET_FEATURE && xfer->wValue == USB_ENDPOINT_HALT && !xfer->wLength &&
+	       (index == dev->bulk_in_endpointAddr || index == dev->bulk_out_endpointAddr);
+}
+
+static int usbdrv_ctrl_start(struct usb_dev *dev, struct usb_ctrl *c, const struct usbdrv_ctrl_xfer __user *uxfer){
+	struct usbdrv_ctrl_xfer xfer;
+	unsigned int pipe;
+	int retval;
+	if(copy_from_user(&xfer,uxfer,sizeof(xfer)))
+		return -EFAULT;
+	if(xfer.wLength > USBDRV_CTRL_MAX_DATA || xfer.reserved || xfer.reserved2)
+		return -EINVAL;
+	c->in=xfer.bRequestType & USB_DIR_IN;
+	/* standard requests that change state belong to usbcore */
+	if((xfer.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD && !c->in && !usbdrv_ctrl_halt(dev,&xfer))
+		return -EPERM;
+	if(!usbdrv_ctrl_ours(dev,&xfer))
+		return -EPERM;
+	c->setup.bRequestType=xfer.bRequestType;
+	c->setup.bRequest=xfer.bRequest;
+	c->setup.wValue=cpu_to_le16(xfer.wValue);
+	c->setup.wIndex=cpu_to_le16(xfer.wIndex);
+	c->setup.wLength=cpu_to_le16(xfer.wLength);
+	c->data=xfer.data;
+	if(xfer.wLength){
+		c->buf=kmalloc(xfer.wLength,GFP_KERNEL);
+		if(!c->buf)
+			return -ENOMEM;
+		if(!c->in && copy_from_user(c->buf,u64_to_user_ptr(xfer.data),xfer.wLength)){
+			retval=-EFAULT;
+			goto free_buf;
+		}
+	}
+	c->urb=usbdrv_urb_get(dev,GFP_KERNEL);
+	if(!c->urb){
+		retval=-ENOMEM;
+		goto free_buf;
+	}
+	init_completion(&c->done);
+	pipe=c->in ? usb_rcvctrlpipe(dev->udev,0) : usb_sndctrlpipe(dev->udev,0);
+	usb_fill_control_urb(c->urb,dev->udev,pipe,(unsigned char *)&c->setup,c->buf,xfer.wLength,usbdrv_ctrl_callback,&c->done);
+	retval=usbdrv_suspend_mark(dev,&c->gen);
+	if(!retval){
+		usb_anchor_urb(c->urb,&dev->ctrl_anchor);
+		retval=usb_submit_urb(c->urb,GFP_KERNEL);
+		if(!retval)
+			return 0;
+		usb_unanchor_urb(c->urb);
+	}
+	usbdrv_urb_put(dev,c->urb);
+	c->urb=NULL;
+free_buf:
+	kfree(c->buf);
+	c->buf=NULL;
+	return retval;
+}
+
+/* Hand one result back to userspace and release the transfer */
+static int usbdrv_ctrl_finish(struct usb_dev *dev, struct usb_ctrl *c, struct usbdrv_ctrl_xfer __user *uxfer, bool copy){
+	u32 actual=c->urb ? c->urb->actual_length : 0;
 	int retval=0;
-	/* Be sure to use iminor to obtain the minor number from the inode structure, and make sure that it corresponds to a device that your driver is actually prepared to handle.*/
-	subminor=iminor(inodep);   
-	interface=usb_find_interface(&usb_drv,subminor); /* find usb_interface pointer for driver and device */
-	if(!interface){
-		pr_err("%s: Can't find device for minor %d",__func__, subminor);
-		retval=-ENODEV;
-		goto exit;
+	if(copy){
+		if(c->in && actual && copy_to_user(u64_to_user_ptr(c->data),c->buf,actual))
+			retval=-EFAULT;
+		else if(put_user(c->status,&uxfer->status) || put_user(actual,&uxfer->actual_length))
+			retval=-EFAULT;
 	}
-	dev = usb_get_intfdata(interface);	/* To retrieve the data, the function usb_get_intfdata should be called:*/
-	if(!dev){
+	if(c->urb)
+		usbdrv_urb_put(dev,c->urb);
+	kfree(c->buf);
+	return retval;
+}
+
+static long usbdrv_ctrl_batch(struct usb_dev *dev, struct usbdrv_ctrl_batch __user *argp){
+	struct usbdrv_ctrl_batch batch;
+	struct usbdrv_ctrl_xfer __user *uxfer;
+	struct usb_ctrl *ctrl, *c;
+	unsigned long timeout;
+	long left;
+	u32 head, next, i, window, ok=0;
+	bool stop, failed=false, parked;
+	int retval, fault=0;
+	if(copy_from_user(&batch,argp,sizeof(batch)))
+		return -EFAULT;
+	if(!batch.count || batch.count > USBDRV_CTRL_MAX_BATCH || batch.flags & ~USBDRV_CTRL_STOP_ON_ERROR || batch.reserved)
+		return -EINVAL;
+	window=batch.max_inflight ? batch.max_inflight : ctrl_in_flight;
+	window=clamp_t(u32,window,1,USBDRV_CTRL_MAX_INFLIGHT);
+	timeout=msecs_to_jiffies(batch.timeout_ms ? batch.timeout_ms : USB_CTRL_SET_TIMEOUT);
+	stop=batch.flags & USBDRV_CTRL_STOP_ON_ERROR;
+	uxfer=u64_to_user_ptr(batch.xfers);
+	ctrl=kcalloc(window,sizeof(*ctrl),GFP_KERNEL);
+	if(!ctrl)
+		return -ENOMEM;
+	/* disconnect waits for us */
+	retval=down_read_interruptible(&dev->io_rwsem);
+	if(retval)
+		goto free;
+	if(dev->gone){
 		retval=-ENODEV;
-		goto exit;
+		goto unlock;
 	}
-	/* increment our usage count for the device */
-	kref_get(&dev->kref);
-	/* save our object in the file's private structure */
-	filep->private_data=dev;
-	return 0;
-exit:
+	retval=usbdrv_pm_get(dev);
+	if(retval)
+		goto unlock;
+	head=next=0;
+	while(head < batch.count){
+		/* keep the window full */
+		for(; next < batch.count && next - head < window; ++next){
+			c=&ctrl[next % window];
+			memset(c,0,sizeof(*c));
+			c->status=(stop && failed) ? -ECANCELED : usbdrv_ctrl_start(dev,c,&uxfer[next]);
+		}
+		c=&ctrl[head % window];
+		parked=false;
+		if(c->urb){
+			left=wait_for_completion_killable_timeout(&c->done,timeout);
+			if(left < 0){
+				retval=-EINTR;
+				goto cancel;
+			}
+			if(!left){
+				usb_kill_urb(c->urb);
+				c->status=-ETIMEDOUT;
+			}else{
+				parked=usbdrv_parked(dev,c->gen,c->urb->status,c->urb->actual_length);
+				c->status=usbdrv_unlink_status(c->urb->status) ? -ECANCELED : c->urb->status;
+			}
+		}else{
+			parked=usbdrv_parked(dev,c->gen,c->status,0);
+		}
+		if(parked && !(stop && failed)){
+			/*
+			 * A suspend stopped it before it ran, and so everything queued
+			 * behind it: start it again once resumed, the others follow
+			 * as the window reaches them.
+			 */
+			retval=usbdrv_wait_resumed(dev);
+			if(retval){
+				/* a restart would run again what already completed */
+				if(retval == -ERESTARTSYS)
+					retval=-EINTR;
+				goto cancel;
+			}
+			usbdrv_ctrl_finish(dev,c,&uxfer[head],false);
+			memset(c,0,sizeof(*c));
+			c->status=usbdrv_ctrl_start(dev,c,&uxfer[head]);
+			continue;
+		}
+		if(c->status){
+			usbdrv_stat_add(dev,USBDRV_STAT_CTRL_ERRORS,1);
+			/* what is still queued behind a failure is called off */
+			if(stop && !failed)
+				for(i=head + 1; i < next; ++i)
+					if(ctrl[i % window].urb)
+						usb_kill_urb(ctrl[i % window].urb);
+			failed=true;
+		}else{
+			ok++;
+		}
+		usbdrv_stat_add(dev,USBDRV_STAT_CTRL_XFERS,1);
+		/* after a fault keep draining, but stop touching user memory */
+		if(!fault)
+			fault=usbdrv_ctrl_finish(dev,c,&uxfer[head],true);
+		else
+			usbdrv_ctrl_finish(dev,c,&uxfer[head],false);
+		++head;
+	}
+	retval=fault;
+	if(!retval && put_user(ok,&argp->completed))
+		retval=-EFAULT;
+	goto put;
+cancel:
+	/* killed or unplugged: call off the whole window, nobody is left to collect it */
+	for(i=head; i < next; ++i){
+		c=&ctrl[i % window];
+		if(c->urb)
+			usb_kill_urb(c->urb);
+		usbdrv_ctrl_finish(dev,c,&uxfer[i],false);
+	}
+put:
+	usbdrv_pm_put(dev);
+unlock:
+	up_read(&dev->io_rwsem);
+free:
+	kfree(ctrl);
 	return retval;
 }
-static  int usb_release(struct inode *inodep, struct file *filep){
-	struct usb_dev *dev;
-	dev=(struct usb_dev *)filep->private_data;
-	if (dev == NULL)
-		return -ENODEV;
-	/* decrement the count on our device */
-	kref_put(&dev->kref, usb_delete);
+
+/* Install, replace or (with count 0) remove the device's receive filter */
+static int usbdrv_set_filter(struct usb_dev *dev, const struct usbdrv_filter *uf){
+	struct usb_rx_filter *filter=NULL, *old;
+	unsigned int i;
+	if(uf->reserved || uf->count > USBDRV_FILTER_MAX_RULES)
+		return -EINVAL;
+	if(uf->default_verdict != USBDRV_FILTER_KEEP && uf->default_verdict != USBDRV_FILTER_DROP)
+		return -EINVAL;
+	if(uf->count){
+		filter=kmalloc(struct_size(filter,rule,uf->count),GFP_KERNEL);
+		if(!filter)
+			return -ENOMEM;
+		if(copy_from_user(filter->rule,u64_to_user_ptr(uf->rules),uf->count * sizeof(filter->rule[0]))){
+			kfree(filter);
+			return -EFAULT;
+		}
+		for(i=0; i < uf->count; ++i){
+			const struct usbdrv_filter_rule *rule=&filter->rule[i];
+			/* a rule has to fit the largest transfer the pool takes in */
+			if(rule->match_len > USBDRV_FILTER_MATCH_MAX || rule->offset > dev->rx_buf_size - rule->match_len ||
+			   rule->verdict >= USBDRV_NR_FILTER_VERDICTS ||
+			   (rule->verdict == USBDRV_FILTER_TAG && !rule->tag) || (rule->max_len && rule->max_len < rule->min_len)){
+				kfree(filter);
+				return -EINVAL;
+			}
+		}
+		filter->count=uf->count;
+		filter->default_verdict=uf->default_verdict;
+	}
+	spin_lock_irq(&dev->rx_lock);
+	old=dev->rx_filter;
+	dev->rx_filter=filter;
+	spin_unlock_irq(&dev->rx_lock);
+	kfree(old);
 	return 0;
 }
 
-static ssize_t usb_read(struct file *filep,char __user *buffer,size_t count,loff_t *offset){
+/* Describe the transfer at the head of rx_ready, the one the next read() returns data from */
+static int usbdrv_rx_record(struct usb_dev *dev, struct usbdrv_rx_record *rec){
+	struct usb_rxbuf *rxb;
 	int retval=0;
-	struct usb_dev *dev;
-	dev=(struct usb_dev *)filep->private_data;
-	if(dev == NULL)
-		return -ENODEV;
-	/* do a blocking bulk read to get data from the device */
-	/*usb_bulk_msg : This function sends a simple bulk message to a specified endpoint and waits for the message to complete, or timeout. */
-	retval=usb_bulk_msg(dev->udev,usb_rcvbulkpipe(dev->udev,dev->bulk_in_endpointAddr),dev->bulk_in_buffer,min(dev->bulk_in_size,count), (int *)&count,HZ*10);
-	/*P1: A pointer to the USB device
-	 *p2: The specific endpoint of the USB device to which this bulk message is to be sent. This value is created with a call to either usb_sndbulkpipe or usb_rcvbulkpipe.
-	 *p3:A pointer to the data to send to the device if this is an OUT endpoint. If this is an IN endpoint, this is a pointer to where the data should be placed after being read from         the device.
-	 *p4:The length of the buffer that is pointed to by the data parameter.min is defined in kernel.h
-	 *p5:A pointer to where the function places the actual number of bytes that have either been transferred to the device or received from the device, depending on the direction of            the endpoint.
-	 *p6: The amount of time, in jiffies, that should be waited before timing out.
-	 *HZ : value for i386 was changed to 1000, yeilding a jiffy interval of 1 ms. Recently (2.6.13) the kernel changed HZ for i386 to 250. (1000 was deemed too high).*/
-	/*If successful, it returns 0, otherwise a negative error number. */
-	/* if the read was successful, copy the data to userspace */
-	if(!retval){
-		if(copy_to_user(buffer, dev->bulk_in_buffer, count))  //  On success, this will be zero. 
-			return -EFAULT;
-		else 
-			return count;
+	memset(rec,0,sizeof(*rec));
+	spin_lock_irq(&dev->rx_lock);
+	rxb=list_first_entry_or_null(&dev->rx_ready,struct usb_rxbuf,node);
+	if(rxb){
+		rec->length=rxb->len;
+		rec->offset=rxb->off;
+		rec->tag=rxb->tag;
+		rec->flags=rxb->flags;
+	}else{
+		retval=-EAGAIN;
 	}
+	spin_unlock_irq(&dev->rx_lock);
 	return retval;
 }
-/* (in) completion routine */
-/*
- *   - Out of memory (-ENOMEM)
- *   - Unplugged device (-ENODEV)
- *   - Stalled endpoint (-EPIPE)
- *   - Too many queued ISO transfers (-EAGAIN)
- *   - Too many requested ISO frames (-EFBIG)
- *   - Invalid INT interval (-EINVAL)
- *   - More than one packet for INT (-EINVAL)
- */
-static void usb_write_bulk_callback(struct urb *urb){
-	if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET ||urb->status == -ESHUTDOWN))
-		pr_debug("%s:  Nonzero write bulk status received: %d",__func__,urb->status);
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev,urb->transfer_buffer_length,urb->transfer_buffer,urb->transfer_dma);
 
-}
-static ssize_t usb_write(struct file *filep, const char __user *buffer, size_t count, loff_t *offset){
-	struct usb_dev *dev;
-	int retval;
-	struct urb *urb=NULL;  /* struct urb - USB Request Block*/
-	char *buf = NULL;
-	dev=(struct usb_dev *)filep->private_data;
-	/* verify that we actually have some data to write */
-	if (count == 0)
+static int usbdrv_set_params(struct usb_client *client, const struct usbdrv_params *params){
+	int i, retval;
+	if(!params->version || params->version > USBDRV_ABI_VERSION)
+		return -EINVAL;
+	for(i=0; i < ARRAY_SIZE(params->reserved); ++i)
+		if(params->reserved[i])
+			return -EINVAL;
+	if(!params->transfer_size || params->transfer_size > USBDRV_MAX_TRANSFER)
+		return -EINVAL;
+	if(!params->queue_depth || params->short_policy & ~(USBDRV_SHORT_NOT_OK | USBDRV_SHORT_ZLP))
+		return -EINVAL;
+	if(params->io_mode >= USBDRV_NR_IO_MODES || params->prio >= USBDRV_NR_PRIO)
+		return -EINVAL;
+	if(params->read_mode >= USBDRV_NR_READ_MODES || params->pm_flags & ~USBDRV_PM_LATENCY_CRITICAL)
+		return -EINVAL;
+	if(params->crc_flags & ~(USBDRV_CRC_VERIFY_RX | USBDRV_CRC_APPEND_TX))
+		return -EINVAL;
+	/* the PM and stream changes below touch the interface, keep disconnect out */
+	retval=down_read_interruptible(&client->dev->io_rwsem);
+	if(retval)
+		return retval;
+	if(client->dev->gone){
+		retval=-ENODEV;
 		goto exit;
-	/* create a urb, and a buffer for it, and copy the data to the urb.URBs are allocated with the following call*/
-	urb=usb_alloc_urb(0,GFP_KERNEL);  /* If the return value is NULL, some error occurred within the USB core*/
-	/*p1:iso_packets If the driver want to use this urb for interrupt, control, or bulk endpoints, pass '0' as the number of iso packets. */
-	if(!urb){
-		retval = -ENOMEM;
-		goto error;
 	}
-	/*usb_buffer_alloc() is renamed to usb_alloc_coherent(), allocate dma-consistent buffer for URB_NO_xxx_DMA_MAP*/
-	buf=usb_alloc_coherent(dev->udev,count,GFP_KERNEL,&urb->transfer_dma);/*dma_addr_t transfer_dma;  (in) dma addr for transfer_buffer */
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
+	if((params->pm_flags ^ client->params.pm_flags) & USBDRV_PM_LATENCY_CRITICAL){
+		retval=usbdrv_pm_latency_hold(client->dev,params->pm_flags & USBDRV_PM_LATENCY_CRITICAL);
+		if(retval)
+			goto exit;
 	}
-	if (copy_from_user(buf, buffer, count)) {
-		retval = -EFAULT;
-		goto error;
+	if(params->read_mode != client->params.read_mode){
+		retval=usbdrv_rx_set_stream(client->dev,params->read_mode == USBDRV_READ_STREAM);
+		if(retval){
+			if((params->pm_flags ^ client->params.pm_flags) & USBDRV_PM_LATENCY_CRITICAL)
+				usbdrv_pm_latency_hold(client->dev,client->params.pm_flags & USBDRV_PM_LATENCY_CRITICAL);
+			goto exit;
+		}
 	}
-	/**
-	 * usb_fill_bulk_urb - macro to help initialize a bulk urb
-	 * @urb: pointer to the urb to initialize.
-	 * @dev: pointer to the struct usb_device for this urb.
-	 * @pipe: the endpoint pipe  : usb_sndbulkpipe(dev, endpoint)
-	 * @transfer_buffer: pointer to the transfer buffer
-	 * @buffer_length: length of the transfer buffer
-	 * @complete_fn: pointer to the usb_complete_t function
-	 * @context: what to set the urb context to.
-	 *
-	 * Initializes a bulk urb with the proper information needed to submit it
-	 * to a device.
-	 */
-	usb_fill_bulk_urb(urb,dev->udev,usb_sndbulkpipe(dev->udev,dev->bulk_out_endpointAddr),buf,count,usb_write_bulk_callback,dev);
-	/*set URB_NO_TRANSFER_DMA_MAP so that usbcore won't map or unmap the buffer.*/
-	/*If short packets should NOT be tolerated, set URB_SHORT_NOT_OK in transfer_flags.*/
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	/* send the data out the bulk port */
-	retval=usb_submit_urb(urb, GFP_KERNEL); //ON submit return 0.
-	if(retval){
-		pr_err("%s: failed submitting write urb, error %d",__func__,retval);
-		goto error;
+	if((params->crc_flags ^ client->params.crc_flags) & USBDRV_CRC_VERIFY_RX){
+		if(params->crc_flags & USBDRV_CRC_VERIFY_RX)
+			atomic_inc(&client->dev->crc_rx_users);
+		else
+			atomic_dec(&client->dev->crc_rx_users);
 	}
-	/* release our reference to this urb, the USB core will eventually free it entirely */
-	usb_free_urb(urb);
-
+	client->params=*params;
+	client->params.version=USBDRV_ABI_VERSION;
 exit:
-	return count;
-error:
-	usb_free_coherent(dev->udev,count,buf,urb->transfer_dma);
-	usb_free_urb(urb);
-	kfree(buf);
+	up_read(&client->dev->io_rwsem);
 	return retval;
 }
+
+static long usb_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+	struct usb_client *client=(struct usb_client *)filep->private_data;
+	struct usb_dev *dev=client->dev;
+	void __user *argp=(void __user *)arg;
+	struct usbdrv_pacing pacing;
+	struct usbdrv_params params;
+	struct usbdrv_bridge bridge;
+	struct usbdrv_filter filter;
+	struct usbdrv_rx_record rec;
+	unsigned long flags;
+	int retval;
+	__u32 prio;
+	switch(cmd){
+	case USBDRV_IOC_SET_PRIO:
+		if(get_user(prio,(__u32 __user *)argp))
+			return -EFAULT;
+		if(prio >= USBDRV_NR_PRIO)
+			return -EINVAL;
+		WRITE_ONCE(client->params.prio,prio);
+		return 0;
+	case USBDRV_IOC_GET_PRIO:
+		return put_user(client->params.prio,(__u32 __user *)argp);
+	case USBDRV_IOC_SET_PACING:
+		if(copy_from_user(&pacing,argp,sizeof(pacing)))
+			return -EFAULT;
+		return usbdrv_set_pacing(dev,&pacing);
+	case USBDRV_IOC_GET_PACING:
+		memset(&pacing,0,sizeof(pacing));
+		spin_lock_irqsave(&dev->lock,flags);
+		pacing.rate=dev->pace_rate;
+		pacing.burst=dev->pace_burst;
+		spin_unlock_irqrestore(&dev->lock,flags);
+		return copy_to_user(argp,&pacing,sizeof(pacing)) ? -EFAULT : 0;
+	case USBDRV_IOC_GET_STATS:
+		return usbdrv_get_stats(dev,argp);
+	case USBDRV_IOC_SUBMIT:
+		return usbdrv_submit(dev,client,argp);
+	case USBDRV_IOC_REAP:
+		return usbdrv_reap(dev,client,argp);
+	case USBDRV_IOC_GET_VERSION:
+		return put_user((__u32)USBDRV_ABI_VERSION,(__u32 __user *)argp);
+	case USBDRV_IOC_GET_PARAMS:
+		return copy_to_user(argp,&client->params,sizeof(client->params)) ? -EFAULT : 0;
+	case USBDRV_IOC_SET_PARAMS:
+		if(copy_from_user(&params,argp,sizeof(params)))
+			return -EFAULT;
+		return usbdrv_set_params(client,&params);
+	case USBDRV_IOC_BRIDGE:
+		if(copy_from_user(&bridge,argp,sizeof(bridge)))
+			return -EFAULT;
+		return usbdrv_bridge_start(client,&bridge);
+	case USBDRV_IOC_BRIDGE_STOP:
+		return usbdrv_bridge_stop(client);
+	case USBDRV_IOC_SET_FILTER:
+		if(copy_from_user(&filter,argp,sizeof(filter)))
+			return -EFAULT;
+		return usbdrv_set_filter(dev,&filter);
+	case USBDRV_IOC_RX_TAG:
+		retval=usbdrv_rx_record(dev,&rec);
+		return retval ? retval : put_user(rec.tag,(__u32 __user *)argp);
+	case USBDRV_IOC_CTRL_BATCH:
+		return usbdrv_ctrl_batch(dev,argp);
+	case USBDRV_IOC_RX_RECORD:
+		retval=usbdrv_rx_record(dev,&rec);
+		if(retval)
+			return retval;
+		return copy_to_user(argp,&rec,sizeof(rec)) ? -EFAULT : 0;
+	default:
+		return -ENOTTY;
+	}
+}
+/* Receive pool state for operators, in the interface's sysfs directory */
+static ssize_t usbdrv_rx_show(struct device *d, char *buf, int what){
+	struct usb_dev *dev=usb_get_intfdata(to_usb_interface(d));
+	unsigned long val;
+	if(!dev)
+		return -ENODEV;
+	spin_lock_irq(&dev->rx_lock);
+	switch(what){
+	case 0: val=dev->rx_nbufs; break;
+	case 1: val=dev->rx_buf_size; break;
+	case 2: val=dev->rx_nfree; break;
+	case 3: val=dev->rx_armed; break;
+	default: val=dev->rx_nready; break;
+	}
+	spin_unlock_irq(&dev->rx_lock);
+	return sysfs_emit(buf,"%lu\n",val);
+}
+
+static ssize_t rx_bufs_show(struct device *d, struct device_attribute *attr, char *buf){
+	return usbdrv_rx_show(d,buf,0);
+}
+static ssize_t rx_buf_size_show(struct device *d, struct device_attribute *attr, char *buf){
+	return usbdrv_rx_show(d,buf,1);
+}
+static ssize_t rx_free_show(struct device *d, struct device_attribute *attr, char *buf){
+	return usbdrv_rx_show(d,buf,2);
+}
+static ssize_t rx_armed_show(struct device *d, struct device_attribute *attr, char *buf){
+	return usbdrv_rx_show(d,buf,3);
+}
+static ssize_t rx_ready_show(struct device *d, struct device_attribute *attr, char *buf){
+	return usbdrv_rx_show(d,buf,4);
+}
+/* last resume to first byte moved, in microseconds */
+static ssize_t resume_latency_us_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct usb_dev *dev=usb_get_intfdata(to_usb_interface(d));
+	if(!dev)
+		return -ENODEV;
+	return sysfs_emit(buf,"%llu\n",div_u64(READ_ONCE(dev->resume_latency_ns),NSEC_PER_USEC));
+}
+/* time spent in probe, and from probe to the first byte moved, in microseconds */
+static ssize_t probe_us_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct usb_dev *dev=usb_get_intfdata(to_usb_interface(d));
+	if(!dev)
+		return -ENODEV;
+	return sysfs_emit(buf,"%llu\n",div_u64(READ_ONCE(dev->probe_ns),NSEC_PER_USEC));
+}
+static ssize_t probe_first_byte_us_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct usb_dev *dev=usb_get_intfdata(to_usb_interface(d));
+	if(!dev)
+		return -ENODEV;
+	return sysfs_emit(buf,"%llu\n",div_u64(READ_ONCE(dev->probe_first_byte_ns),NSEC_PER_USEC));
+}
+static DEVICE_ATTR_RO(rx_bufs);
+static DEVICE_ATTR_RO(rx_buf_size);
+static DEVICE_ATTR_RO(rx_free);
+static DEVICE_ATTR_RO(rx_armed);
+static DEVICE_ATTR_RO(rx_ready);
+static DEVICE_ATTR_RO(resume_latency_us);
+static DEVICE_ATTR_RO(probe_us);
+static DEVICE_ATTR_RO(probe_first_byte_us);
+
+static struct attribute *usb_attrs[] = {
+	&dev_attr_rx_bufs.attr,
+	&dev_attr_rx_buf_size.attr,
+	&dev_attr_rx_free.attr,
+	&dev_attr_rx_armed.attr,
+	&dev_attr_rx_ready.attr,
+	&dev_attr_resume_latency_us.attr,
+	&dev_attr_probe_us.attr,
+	&dev_attr_probe_first_byte_us.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(usb);
+
 /* * @probe: Called to see if the driver is willing to manage a particular
  *      interface on a device.  If it is, probe returns zero and uses
  *      usb_set_intfdata() to associate driver-specific data with the
@@ -234,6 +2715,9 @@ static struct file_operations usb_fops= {
 	.write  = usb_write,
 	.open   = usb_open,
 	.release= usb_release,
+	.poll   = usb_poll,
+	.unlocked_ioctl = usb_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 /**
  * struct usb_class_driver - identifies a USB driver that wants to use the USB major number
@@ -253,6 +2737,310 @@ struct usb_class_driver usb_class={
 	.minor_base = USB_SKEL_MINOR_BASE,
 };
 
+/*
+ * Striped aggregate, /dev/usbdrv_stripe.  Each member device is driven
+ * through a client of its own, as if the aggregate had it open, with the
+ * receive pool streaming so all members move data at the same time.
+ * Members whose device is unplugged stay in the table but are skipped, so
+ * the stripe degrades to the survivors instead of stopping.
+ */
+struct usbdrv_stripe {
+	struct mutex rd_mutex;		/* serializes readers, both held for membership changes */
+	struct mutex wr_mutex;		/* serializes writers */
+	struct usb_client *member[USBDRV_STRIPE_MAX];
+	u32 minor[USBDRV_STRIPE_MAX];
+	unsigned int nr;
+	size_t chunk;			/* bytes per member per turn */
+	unsigned int rd_idx, wr_idx;	/* member whose turn it is */
+	size_t rd_off, wr_off;		/* bytes of its current chunk already moved */
+	atomic64_t read_bytes;
+	atomic64_t write_bytes;
+};
+
+static struct usbdrv_stripe usbdrv_stripe={
+	.rd_mutex=__MUTEX_INITIALIZER(usbdrv_stripe.rd_mutex),
+	.wr_mutex=__MUTEX_INITIALIZER(usbdrv_stripe.wr_mutex),
+};
+
+/*
+ * The member whose turn it is, skipping unplugged ones; a skipped member's
+ * partial chunk is abandoned.  NULL once every member is gone.
+ */
+static struct usb_client *usbdrv_stripe_turn(struct usbdrv_stripe *st, unsigned int *idx, size_t *off){
+	unsigned int i, n;
+	for(i=0; i < st->nr; ++i){
+		n=(*idx + i) % st->nr;
+		if(!READ_ONCE(st->member[n]->dev->gone)){
+			if(i)
+				*off=0;
+			*idx=n;
+			return st->member[n];
+		}
+	}
+	return NULL;
+}
+
+static void usbdrv_stripe_advance(struct usbdrv_stripe *st, unsigned int *idx, size_t *off, size_t len){
+	*off+=len;
+	if(*off < st->chunk)
+		return;
+	*off=0;
+	*idx=(*idx + 1) % st->nr;
+}
+
+/* One read from a member's receive pool, as usb_read() would do it */
+static ssize_t usbdrv_stripe_read_member(struct usb_client *client, char __user *buffer, size_t len, bool nonblock){
+	struct usb_dev *dev=client->dev;
+	ssize_t retval;
+	retval=down_read_interruptible(&dev->io_rwsem);
+	if(retval)
+		return retval;
+	retval=dev->gone ? -ENODEV : usbdrv_pm_get(dev);
+	if(!retval){
+		retval=usbdrv_read_pool(dev,client,buffer,len,nonblock);
+		usbdrv_pm_put(dev);
+	}
+	up_read(&dev->io_rwsem);
+	return retval;
+}
+
+static ssize_t usbdrv_stripe_read(struct file *filep, char __user *buffer, size_t count, loff_t *offset){
+	struct usbdrv_stripe *st=&usbdrv_stripe;
+	struct usb_client *client;
+	size_t done=0;
+	ssize_t retval=0;
+	if(!count)
+		return 0;
+	if(mutex_lock_interruptible(&st->rd_mutex))
+		return -ERESTARTSYS;
+	while(done < count){
+		client=usbdrv_stripe_turn(st,&st->rd_idx,&st->rd_off);
+		if(!client){
+			retval=-ENODEV;
+			break;
+		}
+		/* once we have data, hand it back rather than wait for the next member */
+		retval=usbdrv_stripe_read_member(client,buffer + done,min(count - done,st->chunk - st->rd_off),
+						 done || (filep->f_flags & O_NONBLOCK));
+		if(retval == -ENODEV){
+			/* the rest of the chunk went with its member */
+			retval=-EIO;
+			break;
+		}
+		if(retval <= 0)
+			break;
+		done+=retval;
+		usbdrv_stripe_advance(st,&st->rd_idx,&st->rd_off,retval);
+	}
+	mutex_unlock(&st->rd_mutex);
+	atomic64_add(done,&st->read_bytes);
+	return done ? done : retval;
+}
+
+static ssize_t usbdrv_stripe_write(struct file *filep, const char __user *buffer, size_t count, loff_t *offset){
+	struct usbdrv_stripe *st=&usbdrv_stripe;
+	struct usb_client *client;
+	size_t done=0, len;
+	int retval=0;
+	if(!count)
+		return 0;
+	if(mutex_lock_interruptible(&st->wr_mutex))
+		return -ERESTARTSYS;
+	while(done < count){
+		client=usbdrv_stripe_turn(st,&st->wr_idx,&st->wr_off);
+		if(!client){
+			retval=-ENODEV;
+			break;
+		}
+		len=min(count - done,st->chunk - st->wr_off);
+		len=min_t(size_t,len,client->params.transfer_size);
+		retval=usbdrv_write_reserve(client->dev,client,filep->f_flags & O_NONBLOCK);
+		if(retval >= 0)
+			retval=usbdrv_write_queue(client->dev,client,retval,buffer + done,len,0,false,NULL,NULL);
+		if(retval == -ENODEV){
+			retval=-EIO;
+			break;
+		}
+		if(retval)
+			break;
+		done+=len;
+		usbdrv_stripe_advance(st,&st->wr_idx,&st->wr_off,len);
+	}
+	mutex_unlock(&st->wr_mutex);
+	atomic64_add(done,&st->write_bytes);
+	return done ? done : retval;
+}
+
+/* Membership changes restart the rotation; called with both stripe mutexes held */
+static void usbdrv_stripe_rewind(struct usbdrv_stripe *st){
+	st->rd_idx=st->wr_idx=0;
+	st->rd_off=st->wr_off=0;
+}
+
+static int usbdrv_stripe_add(struct usbdrv_stripe *st, u32 minor){
+	struct usb_client *client;
+	struct usb_dev *dev;
+	unsigned int i;
+	int retval;
+	for(i=0; i < st->nr; ++i)
+		if(st->minor[i] == minor)
+			return -EEXIST;
+	if(st->nr == USBDRV_STRIPE_MAX)
+		return -ENOSPC;
+	dev=usbdrv_dev_get(minor);
+	if(IS_ERR(dev))
+		return PTR_ERR(dev);
+	/* the client takes its own reference */
+	client=usbdrv_client_alloc(dev);
+	kref_put(&dev->kref,usb_delete);
+	if(!client)
+		return -ENOMEM;
+	retval=usbdrv_rx_set_stream(dev,true);
+	if(retval){
+		kref_put(&client->ref,usbdrv_client_free);
+		kref_put(&dev->kref,usb_delete);
+		return retval;
+	}
+	client->params.read_mode=USBDRV_READ_STREAM;
+	st->member[st->nr]=client;
+	st->minor[st->nr]=minor;
+	st->nr++;
+	usbdrv_stripe_rewind(st);
+	return 0;
+}
+
+/* Drop member @i; it goes away like a closed fd, queued writes still drain */
+static void usbdrv_stripe_del(struct usbdrv_stripe *st, unsigned int i){
+	struct usb_client *client=st->member[i];
+	struct usb_dev *dev=client->dev;
+	usbdrv_rx_set_stream(dev,false);
+	kref_put(&client->ref,usbdrv_client_free);
+	kref_put(&dev->kref,usb_delete);
+	st->nr--;
+	memmove(&st->member[i],&st->member[i + 1],(st->nr - i) * sizeof(st->member[0]));
+	memmove(&st->minor[i],&st->minor[i + 1],(st->nr - i) * sizeof(st->minor[0]));
+	usbdrv_stripe_rewind(st);
+}
+
+static void usbdrv_stripe_info(struct usbdrv_stripe *st, struct usbdrv_stripe_info *info){
+	unsigned int i;
+	memset(info,0,sizeof(*info));
+	info->chunk_size=st->chunk;
+	info->nr_members=st->nr;
+	for(i=0; i < st->nr; ++i){
+		info->minor[i]=st->minor[i];
+		if(READ_ONCE(st->member[i]->dev->gone))
+			info->gone|=1U << i;
+	}
+	info->read_bytes=atomic64_read(&st->read_bytes);
+	info->write_bytes=atomic64_read(&st->write_bytes);
+}
+
+static long usbdrv_stripe_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+	struct usbdrv_stripe *st=&usbdrv_stripe;
+	void __user *argp=(void __user *)arg;
+	struct usbdrv_stripe_info info;
+	unsigned int i;
+	__u32 val;
+	long retval;
+	if(cmd == USBDRV_IOC_STRIPE_INFO){
+		mutex_lock(&st->wr_mutex);
+		mutex_lock(&st->rd_mutex);
+		usbdrv_stripe_info(st,&info);
+		mutex_unlock(&st->rd_mutex);
+		mutex_unlock(&st->wr_mutex);
+		return copy_to_user(argp,&info,sizeof(info)) ? -EFAULT : 0;
+	}
+	if(cmd != USBDRV_IOC_STRIPE_ADD && cmd != USBDRV_IOC_STRIPE_DEL && cmd != USBDRV_IOC_STRIPE_SET_CHUNK)
+		return -ENOTTY;
+	if(get_user(val,(__u32 __user *)argp))
+		return -EFAULT;
+	mutex_lock(&st->wr_mutex);
+	mutex_lock(&st->rd_mutex);
+	switch(cmd){
+	case USBDRV_IOC_STRIPE_ADD:
+		retval=usbdrv_stripe_add(st,val);
+		break;
+	case USBDRV_IOC_STRIPE_DEL:
+		retval=-ENOENT;
+		for(i=0; i < st->nr; ++i){
+			if(st->minor[i] == val){
+				usbdrv_stripe_del(st,i);
+				retval=0;
+				break;
+			}
+		}
+		break;
+	default:
+		retval=-EINVAL;
+		if(val){
+			st->chunk=val;
+			usbdrv_stripe_rewind(st);
+			retval=0;
+		}
+		break;
+	}
+	mutex_unlock(&st->rd_mutex);
+	mutex_unlock(&st->wr_mutex);
+	return retval;
+}
+
+static const struct file_operations usbdrv_stripe_fops={
+	.owner=THIS_MODULE,
+	.open=nonseekable_open,
+	.read=usbdrv_stripe_read,
+	.write=usbdrv_stripe_write,
+	.unlocked_ioctl=usbdrv_stripe_ioctl,
+	.compat_ioctl=compat_ptr_ioctl,
+};
+
+static struct miscdevice usbdrv_stripe_misc={
+	.minor=MISC_DYNAMIC_MINOR,
+	.name="usbdrv_stripe",
+	.fops=&usbdrv_stripe_fops,
+};
+
+/*
+ * Add receive buffers until the pool has @want or memory runs out.  Each one
+ * is armed right away if the pool streams, and may start a waiting reader.
+ */
+static void usbdrv_rx_pool_grow(struct usb_dev *dev, unsigned int want){
+	unsigned int order=get_order(dev->rx_buf_size);
+	struct usb_rxbuf *rxb;
+	want=min_t(unsigned int,want,max_t(unsigned int,rx_bufs,1));
+	while(dev->rx_nbufs < want && !READ_ONCE(dev->gone)){
+		rxb=&dev->rx_bufs[dev->rx_nbufs];
+		if(usbdrv_rx_buf_init(dev,rxb,order))
+			break;
+		spin_lock_irq(&dev->rx_lock);
+		list_add_tail(&rxb->node,&dev->rx_free);
+		dev->rx_nfree++;
+		dev->rx_nbufs++;
+		usbdrv_rx_fill(dev);
+		spin_unlock_irq(&dev->rx_lock);
+		wake_up_interruptible(&dev->rx_wait);
+	}
+}
+
+/*
+ * The part of probe nobody has to wait for: the rest of the receive pool and
+ * the idle urbs.  Until the urb pool is full a transfer allocates its urb.
+ */
+static void usbdrv_warm_work(struct work_struct *work){
+	struct usb_dev *dev=container_of(work,struct usb_dev,warm_work);
+	unsigned int want=max_t(unsigned int,rx_bufs,1), i;
+	struct urb *urb;
+	usbdrv_rx_pool_grow(dev,want);
+	if(dev->rx_nbufs < want || get_order(dev->rx_buf_size) != rx_buf_order)
+		dev_warn(&dev->interface->dev,"receive pool is %u x %zu bytes\n",dev->rx_nbufs,dev->rx_buf_size);
+	for(i=READ_ONCE(dev->urb_pool_count); i < dev->urb_pool_size && !READ_ONCE(dev->gone); ++i){
+		urb=usb_alloc_urb(0,GFP_KERNEL);
+		if(!urb)
+			break;
+		usbdrv_urb_put(dev,urb);
+	}
+}
+
 static int usb_probe(struct usb_interface *interface,const struct usb_device_id *id){
 	struct usb_dev *dev=NULL;
 	struct usb_host_interface *interface_disc; 
@@ -260,19 +3048,54 @@ static int usb_probe(struct usb_interface *interface,const struct usb_device_id
 	size_t buffer_size;
 	int i;
 	int retval = -ENOMEM;
-	/* allocate memory for our device state and initialize it */
-	dev=kmalloc(sizeof(struct usb_dev),GFP_KERNEL);
+	ktime_t start=ktime_get();
+	/*
+	 * Only what the first transfer needs is set up here, the rest of the
+	 * pools follow from warm_work once the node is registered.
+	 */
+	dev=kzalloc(sizeof(struct usb_dev),GFP_KERNEL);
 	if(dev==NULL){
-		pr_err("kmalloc: Out of memory\n");
+		pr_err("kzalloc: Out of memory\n");
 		goto error;
 	}
-	memset(dev,0x00,sizeof(*dev)); /*Clearing memory*/
+	dev->probe_stamp=start;
 	kref_init(&dev->kref);
-	mutex_init(&dev->io_mutex);
+	init_rwsem(&dev->io_rwsem);
+	mutex_init(&dev->pm_mutex);
+	mutex_init(&dev->park_mutex);
+	INIT_LIST_HEAD(&dev->clients);
+	init_waitqueue_head(&dev->resume_wait);
+	INIT_LIST_HEAD(&dev->async_parked);
 	spin_lock_init(&dev->lock);
+	init_usb_anchor(&dev->submitted);
+	init_waitqueue_head(&dev->wq_wait);
+	for(i=0;i < USBDRV_NR_PRIO; ++i){
+		INIT_LIST_HEAD(&dev->wq[i]);
+		INIT_LIST_HEAD(&dev->wq_retry[i]);
+	}
+	spin_lock_init(&dev->recover_lock);
+	INIT_DELAYED_WORK(&dev->recover_work,usbdrv_recover_work);
+	hrtimer_setup(&dev->pace_timer,usbdrv_pace_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL_SOFT);
+	spin_lock_init(&dev->urb_lock);
+	spin_lock_init(&dev->rx_lock);
+	INIT_LIST_HEAD(&dev->rx_free);
+	INIT_LIST_HEAD(&dev->rx_ready);
+	init_usb_anchor(&dev->rx_anchor);
+	init_usb_anchor(&dev->read_anchor);
+	init_usb_anchor(&dev->ctrl_anchor);
+	INIT_WORK(&dev->warm_work,usbdrv_warm_work);
+	init_usb_anchor(&dev->bridge_anchor);
+	INIT_LIST_HEAD(&dev->bridge_parked);
+	INIT_LIST_HEAD(&dev->bridge_srcs);
+	init_waitqueue_head(&dev->rx_wait);
+	dev->urb_pool=kcalloc(urb_pool_size,sizeof(*dev->urb_pool),GFP_KERNEL);
+	if(urb_pool_size && !dev->urb_pool)
+		goto error;
+	dev->urb_pool_size=urb_pool_size;
 	/*usb_get_dev — increments the reference count of the usb device structure*/
 	dev->udev=usb_get_dev(interface_to_usbdev(interface));  /* interface_to_usbdev is convert interface to udev*/
-	dev->interface=interface;
+	/* held until the last fd is gone, release touches it after disconnect */
+	dev->interface=usb_get_intf(interface);
 	/* set up the endpoint information */
 	/* use only the first bulk-in and bulk-out endpoints */
 	interface_disc=interface->cur_altsetting;   /* The currently active alternate setting */
@@ -293,18 +3116,13 @@ static int usb_probe(struct usb_interface *interface,const struct usb_device_id
 	/* use only the first bulk-in and bulk-out endpoints */
 
 	for(i=0;i < interface_disc->desc.bNumEndpoints; ++i){  /*  Usb device driver usually want to detect wahat the endpoint address and buffer size are for the devices*/
-		endpoint=&interface_disc->endpoint[i].desc;      /*  @desc: descriptor for this endpoint, wMaxPacketSize in native byteorder*/
+		endpoint=&interface_disc->endpoint[i].desc;      /*  @desc: descriptor for this endpoint, wMaxPacketSize little-endian as on the wire*/
 		if(!dev->bulk_in_endpointAddr && usb_endpoint_is_bulk_in(endpoint)){
 		/*Used to signify direction of data for a UsbEndpoint is IN (device to host) */
 		/* we found a bulk in endpoint */
-			buffer_size=endpoint->wMaxPacketSize;
+			buffer_size=usb_endpoint_maxp(endpoint);
 			dev->bulk_in_size=buffer_size;
 			dev->bulk_in_endpointAddr=endpoint->bEndpointAddress;
-			dev->bulk_in_buffer=kmalloc(buffer_size,GFP_KERNEL);
-			if(dev->bulk_in_buffer==NULL){
-				pr_err("kmalloc: Couldn't alloc memory-bulk_in_buffer\n");
-				goto error; 
-			}
 		}
 		if(!dev->bulk_out_endpointAddr && usb_endpoint_is_bulk_out(endpoint)) {
 			/* we found a bulk out endpoint */
@@ -317,6 +3135,25 @@ static int usb_probe(struct usb_interface *interface,const struct usb_device_id
 		pr_err("ENDPOINT: Could not find both bulk-in and bulk-out endpoints\n");
 		goto error;
 	}
+	/* receive lengths are rounded to whole packets, so it divides */
+	if(!dev->bulk_in_size){
+		pr_err("ENDPOINT: bulk-in endpoint has a max packet size of 0\n");
+		retval=-ENODEV;
+		goto error;
+	}
+	retval=usbdrv_rx_pool_init(dev);
+	if(retval){
+		pr_err("Couldn't allocate the receive pool\n");
+		goto error;
+	}
+	usbdrv_rx_pool_grow(dev,probe_rx_bufs);
+	/*
+	 * time to first byte is measured from here on; a pre-armed pool starts
+	 * it now, before the node exists so the first open can't miss it
+	 */
+	set_bit(USBDRV_PM_PROBE_TIMING,&dev->pm_flags);
+	if(rx_prearm && !usbdrv_rx_set_stream(dev,true))
+		set_bit(USBDRV_PM_PREARMED,&dev->pm_flags);
 	/* save our data pointer in this interface device */
 	/*Because the USB driver needs to retrieve the local data structure that is associated with this 
 	 *struct usb_interface later in the lifecycle of the device, the function usb_set_intfdata can be called*/
@@ -327,8 +3164,16 @@ static int usb_probe(struct usb_interface *interface,const struct usb_device_id
 		/* something prevented us from registering this driver */
 		pr_err("usb_register_dev: Not able to get a minor for this device.\n");
 		usb_set_intfdata(interface, NULL);
+		usbdrv_rx_prearm_end(dev);
+		usb_kill_anchored_urbs(&dev->rx_anchor);
 		goto error;
 	}
+	if(autosuspend_ms >= 0){
+		pm_runtime_set_autosuspend_delay(&dev->udev->dev,autosuspend_ms);
+		usb_enable_autosuspend(dev->udev);
+	}
+	schedule_work(&dev->warm_work);
+	dev->probe_ns=ktime_to_ns(ktime_sub(ktime_get(),start));
 	/* let the user know what node this device is now attached to */
 	pr_info("USB device now attached to USBdrv-%d", interface->minor);
 	pr_info("USB device  (%04X:%04X) is plugged\n", id->idVendor, id->idProduct);
@@ -344,18 +3189,191 @@ error:
 void usb_disconnect(struct usb_interface *interface){
 	struct usb_dev *dev;
 	int minor = interface->minor;  /* minor number this interface is bound to */
+	struct usb_wreq *req;
+	ktime_t start=ktime_get();
+	LIST_HEAD(queued);
+	int prio;
 	/* prevent skel_open() from racing skel_disconnect() */
 	dev=usb_get_intfdata(interface);
-	//spin_lock(&dev->lock);
-	mutex_lock(&dev->io_mutex);
+	mutex_lock(&usbdrv_lookup_mutex);
 	usb_set_intfdata(interface, NULL);
+	mutex_unlock(&usbdrv_lookup_mutex);
 	/* give back our minor */
 	usb_deregister_dev(interface, &usb_class);
-	//	spin_unlock(&dev->lock);
-	mutex_unlock(&dev->io_mutex);
+	/* stop the write queue: drop what was never submitted, kill the rest */
+	spin_lock_irq(&dev->lock);
+	dev->gone=true;
+	for(prio=0; prio < USBDRV_NR_PRIO; ++prio){
+		list_for_each_entry(req,&dev->wq[prio],node){
+			atomic_dec(&dev->wq_count[prio]);
+			req->state=USBDRV_WREQ_DONE;
+			req->status=-ENODEV;
+		}
+		list_for_each_entry(req,&dev->wq_retry[prio],node){
+			atomic_dec(&dev->wq_count[prio]);
+			req->state=USBDRV_WREQ_DONE;
+			req->status=-ENODEV;
+		}
+		list_splice_tail_init(&dev->wq_retry[prio],&queued);
+		list_splice_tail_init(&dev->wq[prio],&queued);
+	}
+	spin_unlock_irq(&dev->lock);
+	/*
+	 * Cancel the reads first so their callers drain while we stop the rest.
+	 * Poisoned, so a reader that missed gone can't start a transfer either.
+	 */
+	usb_poison_anchored_urbs(&dev->rx_anchor);
+	usb_poison_anchored_urbs(&dev->read_anchor);
+	usb_poison_anchored_urbs(&dev->ctrl_anchor);
+	wake_up_interruptible(&dev->rx_wait);
+	wake_up_all(&dev->resume_wait);
+	/* gone is set, so neither the timer nor the recovery work can be re-armed once cancelled */
+	hrtimer_cancel(&dev->pace_timer);
+	cancel_delayed_work_sync(&dev->recover_work);
+	cancel_work_sync(&dev->warm_work);
+	usbdrv_wreq_finish_list(&queued);
+	usb_kill_anchored_urbs(&dev->submitted);
+	wake_up_interruptible(&dev->wq_wait);
+	/* everybody in I/O has been woken or had their transfer killed; let them leave */
+	down_write(&dev->io_rwsem);
+	up_write(&dev->io_rwsem);
+	/* a direct read that stalled may have asked for a clear-halt on its way out */
+	cancel_delayed_work_sync(&dev->recover_work);
 	/* decrement our usage count */
 	kref_put(&dev->kref, usb_delete);
-	pr_info("USB drv #%d now disconnected", minor);
+	dev_dbg(&interface->dev,"disconnect took %lld us\n",ktime_us_delta(ktime_get(),start));
+	pr_info("USB drv #%d now disconnected\n", minor);
+}
+
+/*
+ * A reset (ours from the recovery worker, or anybody's) kills every transfer.
+ * Hold both queues so the killed writes are kept for resubmission rather than
+ * failed, and restart everything once the device is back.
+ */
+static int usb_pre_reset(struct usb_interface *interface){
+	struct usb_dev *dev=usb_get_intfdata(interface);
+	spin_lock_irq(&dev->lock);
+	dev->resetting=true;
+	dev->wq_halted=true;
+	spin_unlock_irq(&dev->lock);
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_halted=true;
+	spin_unlock_irq(&dev->rx_lock);
+	cancel_delayed_work_sync(&dev->recover_work);
+	usb_kill_anchored_urbs(&dev->submitted);
+	usb_kill_anchored_urbs(&dev->rx_anchor);
+	return 0;
+}
+
+static int usb_post_reset(struct usb_interface *interface){
+	struct usb_dev *dev=usb_get_intfdata(interface);
+	/* the reset cleared every halt, and toggles start over */
+	clear_bit(USBDRV_HALT_IN,&dev->recover_flags);
+	clear_bit(USBDRV_HALT_OUT,&dev->recover_flags);
+	spin_lock_irq(&dev->lock);
+	dev->resetting=false;
+	spin_unlock_irq(&dev->lock);
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_errors=0;
+	spin_unlock_irq(&dev->rx_lock);
+	usbdrv_stat_add(dev,USBDRV_STAT_RESETS,1);
+	usbdrv_restart_queues(dev);
+	return 0;
+}
+
+/*
+ * Runtime or system suspend.  Transfers hold the device awake, so
+ * autosuspend only comes when it is idle.  On system suspend writes, control
+ * transfers and what sources bridge into us get a moment to finish; the rest
+ * is stopped here rather than flushed by usbcore, and parked to start again
+ * on resume: writes on wq_retry, submitted IN transfers on async_parked,
+ * bridged buffers on their source's bridge_parked, direct reads and control
+ * batches in their callers.  The receive pool is disarmed, keeping anything
+ * already received for readers.
+ */
+static int usb_suspend(struct usb_interface *interface, pm_message_t message){
+	struct usb_dev *dev=usb_get_intfdata(interface);
+	struct usb_client *client;
+	struct usb_dev *src;
+	if(!dev)
+		return 0;
+	spin_lock_irq(&dev->lock);
+	dev->suspended=true;
+	/* pairs with usbdrv_suspend_mark() */
+	smp_wmb();
+	dev->suspend_gen++;
+	dev->wq_halted=true;
+	spin_unlock_irq(&dev->lock);
+	spin_lock_irq(&dev->rx_lock);
+	dev->rx_halted=true;
+	spin_unlock_irq(&dev->rx_lock);
+	cancel_delayed_work_sync(&dev->recover_work);
+	if(!usb_wait_anchor_empty_timeout(&dev->submitted,1000))
+		usb_kill_anchored_urbs(&dev->submitted);
+	if(!usb_wait_anchor_empty_timeout(&dev->ctrl_anchor,1000))
+		usb_kill_anchored_urbs(&dev->ctrl_anchor);
+	usb_kill_anchored_urbs(&dev->rx_anchor);
+	usb_kill_anchored_urbs(&dev->read_anchor);
+	mutex_lock(&dev->park_mutex);
+	list_for_each_entry(client,&dev->clients,node)
+		usb_kill_anchored_urbs(&client->async_anchor);
+	list_for_each_entry(src,&dev->bridge_srcs,bridge_node)
+		if(!usb_wait_anchor_empty_timeout(&src->bridge_anchor,1000))
+			usb_kill_anchored_urbs(&src->bridge_anchor);
+	mutex_unlock(&dev->park_mutex);
+	usbdrv_stat_add(dev,USBDRV_STAT_SUSPENDS,1);
+	return 0;
+}
+
+static int usb_resume(struct usb_interface *interface){
+	struct usb_dev *dev=usb_get_intfdata(interface);
+	struct usb_async *async, *tmp;
+	struct usb_dev *src;
+	LIST_HEAD(parked);
+	LIST_HEAD(failed);
+	if(!dev)
+		return 0;
+	dev->resume_stamp=ktime_get();
+	smp_mb__before_atomic();
+	set_bit(USBDRV_PM_TIMING,&dev->pm_flags);
+	spin_lock_irq(&dev->lock);
+	dev->suspended=false;
+	/* parked IN transfers go out again ahead of any submitted from now on */
+	list_splice_init(&dev->async_parked,&parked);
+	list_for_each_entry_safe(async,tmp,&parked,node){
+		list_del(&async->node);
+		async->status=usbdrv_async_start(dev,async);
+		if(async->status)
+			list_add_tail(&async->node,&failed);
+	}
+	spin_unlock_irq(&dev->lock);
+	list_for_each_entry_safe(async,tmp,&failed,node){
+		list_del(&async->node);
+		usbdrv_async_done(async->client,async,async->status,0);
+		usbdrv_pm_put(dev);
+	}
+	wake_up_all(&dev->resume_wait);
+	mutex_lock(&dev->park_mutex);
+	list_for_each_entry(src,&dev->bridge_srcs,bridge_node)
+		usbdrv_bridge_unpark(src);
+	mutex_unlock(&dev->park_mutex);
+	usbdrv_stat_add(dev,USBDRV_STAT_RESUMES,1);
+	/* recovery interrupted by the suspend picks up where it stopped */
+	if(dev->recover_flags & (BIT(USBDRV_HALT_IN) | BIT(USBDRV_HALT_OUT)))
+		schedule_delayed_work(&dev->recover_work,0);
+	else
+		usbdrv_restart_queues(dev);
+	return 0;
+}
+
+static int usb_reset_resume(struct usb_interface *interface){
+	struct usb_dev *dev=usb_get_intfdata(interface);
+	/* the device was reset while suspended, so nothing is halted any more */
+	if(dev){
+		clear_bit(USBDRV_HALT_IN,&dev->recover_flags);
+		clear_bit(USBDRV_HALT_OUT,&dev->recover_flags);
+	}
+	return usb_resume(interface);
 }
 
 static struct usb_driver usb_drv={
@@ -363,15 +3381,33 @@ static struct usb_driver usb_drv={
 	.id_table= usb_table,
 	.probe= usb_probe,
 	.disconnect=usb_disconnect,
+	.pre_reset=usb_pre_reset,
+	.post_reset=usb_post_reset,
+	.suspend=usb_suspend,
+	.resume=usb_resume,
+	.reset_resume=usb_reset_resume,
+	.supports_autosuspend=1,
+	.dev_groups=usb_groups,
 };
 
 int __init usb_init(void){
+	int retval;
 	pr_info("Initialization of USB driver\n");
-	usb_register(&usb_drv);
-	return 0;
+	usbdrv_stripe.chunk=max(stripe_chunk_kb,1U) * 1024;
+	retval=misc_register(&usbdrv_stripe_misc);
+	if(retval)
+		return retval;
+	retval=usb_register(&usb_drv);
+	if(retval)
+		misc_deregister(&usbdrv_stripe_misc);
+	return retval;
 }
 
 void __exit usb_exit(void){
+	misc_deregister(&usbdrv_stripe_misc);
+	/* the members hold their devices */
+	while(usbdrv_stripe.nr)
+		usbdrv_stripe_del(&usbdrv_stripe,usbdrv_stripe.nr - 1);
 	usb_deregister(&usb_drv);
 }
 
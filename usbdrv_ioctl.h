@@ -0,0 +1,351 @@
+/*
+ * usbdrv_ioctl.h - ioctl interface of the usbdev driver (/dev/usbdrv%d)
+ *
+ * This header is shared by the driver and by userspace programs, so keep it
+ * free of kernel-only types.
+ */
+#ifndef _USBDRV_IOCTL_H
+#define _USBDRV_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define USBDRV_IOC_MAGIC	0xBC
+
+/* bumped whenever a structure below gains meaning in its reserved space */
+#define USBDRV_ABI_VERSION	4
+
+/*
+ * Write priority classes.  Writes on a USBDRV_PRIO_HIGH fd are submitted
+ * ahead of any queued USBDRV_PRIO_BULK data and never wait behind more than
+ * the driver's bulk in-flight limit (module parameter bulk_inflight_kb).
+ */
+enum {
+	USBDRV_PRIO_BULK = 0,
+	USBDRV_PRIO_HIGH = 1,
+	USBDRV_NR_PRIO
+};
+
+/* get/set the priority class used by write() on this fd */
+#define USBDRV_IOC_SET_PRIO	_IOW(USBDRV_IOC_MAGIC, 1, __u32)
+#define USBDRV_IOC_GET_PRIO	_IOR(USBDRV_IOC_MAGIC, 2, __u32)
+
+/*
+ * Token-bucket pacing of the device's write queue.  Data leaves at no more
+ * than @rate bytes per second on average, in bursts of at most @burst bytes.
+ * A @rate of 0 turns pacing off.  The setting is per device, shared by all
+ * fds open on it.
+ */
+struct usbdrv_pacing {
+	__u64 rate;		/* bytes per second, 0 = unlimited */
+	__u32 burst;		/* bucket depth in bytes */
+	__u32 reserved;
+};
+
+#define USBDRV_IOC_SET_PACING	_IOW(USBDRV_IOC_MAGIC, 3, struct usbdrv_pacing)
+#define USBDRV_IOC_GET_PACING	_IOR(USBDRV_IOC_MAGIC, 4, struct usbdrv_pacing)
+
+/*
+ * Per-device counters, indexes into usbdrv_stats.counter[].  New counters
+ * are only ever appended; @nr tells how many the running driver fills in.
+ */
+enum {
+	USBDRV_STAT_WRITES_BULK,	/* writes queued at USBDRV_PRIO_BULK */
+	USBDRV_STAT_WRITES_HIGH,	/* writes queued at USBDRV_PRIO_HIGH */
+	USBDRV_STAT_WRITE_BYTES,	/* bytes accepted by write() */
+	USBDRV_STAT_PACED,		/* times the write queue waited for tokens */
+	USBDRV_STAT_PACED_NS,		/* total time spent waiting for tokens */
+	USBDRV_STAT_DIRECT_READS,	/* reads done straight into user pages */
+	USBDRV_STAT_DIRECT_READ_BYTES,	/* bytes read that way */
+	USBDRV_STAT_RX_TRANSFERS,	/* receive pool transfers completed */
+	USBDRV_STAT_RX_BYTES,		/* bytes received into the pool */
+	USBDRV_STAT_RX_FULL,		/* times every pool buffer waited for readers */
+	USBDRV_STAT_CLEAR_HALTS,	/* stalled endpoints cleared by error recovery */
+	USBDRV_STAT_RESUBMITS,		/* writes resubmitted after a transfer error */
+	USBDRV_STAT_RESETS,		/* device resets survived */
+	USBDRV_STAT_RECOVERY_GIVEUPS,	/* errors passed on after recover_retries attempts */
+	USBDRV_STAT_SUSPENDS,		/* runtime and system suspends */
+	USBDRV_STAT_RESUMES,
+	USBDRV_STAT_RESUME_FIRST_BYTE_NS,	/* total time from resume to the first byte moved */
+	USBDRV_STAT_BRIDGE_XFERS,	/* receive buffers sent on by the bridge */
+	USBDRV_STAT_BRIDGE_BYTES,
+	USBDRV_STAT_BRIDGE_ERRORS,	/* bridged buffers dropped on either side */
+	USBDRV_STAT_BRIDGE_THROTTLED,	/* times every pool buffer waited for the bridge target */
+	USBDRV_STAT_FILTER_KEPT,	/* received transfers the filter passed unchanged */
+	USBDRV_STAT_FILTER_DROPPED,	/* received transfers the filter threw away */
+	USBDRV_STAT_FILTER_DROPPED_BYTES,
+	USBDRV_STAT_FILTER_TAGGED,	/* received transfers the filter passed with a tag */
+	USBDRV_STAT_CRC_RX_OK,		/* received transfers whose CRC trailer checked out */
+	USBDRV_STAT_CRC_RX_BAD,		/* received transfers flagged USBDRV_RX_CRC_BAD */
+	USBDRV_STAT_CRC_TX,		/* writes sent with a CRC trailer */
+	USBDRV_STAT_CRC_BYTES,		/* bytes run through CRC-32C either way */
+	USBDRV_STAT_CRC_CYCLES,		/* cycles spent on it; divide by crc_bytes for cycles/byte */
+	USBDRV_STAT_CTRL_XFERS,		/* control transfers run by USBDRV_IOC_CTRL_BATCH */
+	USBDRV_STAT_CTRL_ERRORS,	/* of those, the ones that failed */
+	USBDRV_STAT_NR
+};
+
+#define USBDRV_STAT_SLOTS	64
+
+struct usbdrv_stats {
+	__u32 nr;			/* valid entries in counter[] */
+	__u32 reserved;
+	__u64 counter[USBDRV_STAT_SLOTS];
+};
+
+#define USBDRV_IOC_GET_STATS	_IOR(USBDRV_IOC_MAGIC, 5, struct usbdrv_stats)
+
+/* returns USBDRV_ABI_VERSION of the running driver */
+#define USBDRV_IOC_GET_VERSION	_IOR(USBDRV_IOC_MAGIC, 6, __u32)
+
+/* usbdrv_params.short_policy flags */
+#define USBDRV_SHORT_NOT_OK	0x1	/* a short read fails with -EREMOTEIO */
+#define USBDRV_SHORT_ZLP	0x2	/* end writes that fill whole packets with a zero length packet */
+
+/* usbdrv_params.io_mode */
+enum {
+	USBDRV_IO_ASYNC = 0,	/* write() returns once the data is queued */
+	USBDRV_IO_SYNC = 1,	/* write() waits for the transfer and reports its result */
+	USBDRV_NR_IO_MODES
+};
+
+/* usbdrv_params.read_mode (ABI version 2) */
+enum {
+	USBDRV_READ_ONESHOT = 0,	/* each read() starts a transfer sized for itself */
+	USBDRV_READ_STREAM = 1,		/* keep the receive pool armed while this fd is open */
+	USBDRV_NR_READ_MODES
+};
+
+/* usbdrv_params.pm_flags (ABI version 3) */
+#define USBDRV_PM_LATENCY_CRITICAL	0x1	/* keep the device resumed and USB 3 link power management off while set */
+
+/*
+ * usbdrv_params.crc_flags (ABI version 4).  The CRC is the 4 byte
+ * little-endian CRC-32C (Castagnoli, as used by iSCSI) of a transfer's
+ * payload, carried as its last 4 bytes; one transfer is one record.
+ */
+#define USBDRV_CRC_VERIFY_RX	0x1	/* check the trailer of every received transfer, see USBDRV_IOC_RX_RECORD */
+#define USBDRV_CRC_APPEND_TX	0x2	/* append a trailer to every write of this fd */
+#define USBDRV_CRC_SIZE		4
+
+/*
+ * Per-fd I/O parameters.  Read them with USBDRV_IOC_GET_PARAMS, change the
+ * fields of interest and write them back with USBDRV_IOC_SET_PARAMS.  Set
+ * @version to the USBDRV_ABI_VERSION the program was built with; reserved
+ * fields must be zero.
+ */
+struct usbdrv_params {
+	__u32 version;
+	__u32 read_timeout_ms;	/* read() gives up after this long, 0 = never */
+	__u32 write_timeout_ms;	/* write() waits this long for queue space or its transfer, 0 = forever */
+	__u32 transfer_size;	/* bytes per urb, at most USBDRV_MAX_TRANSFER */
+	__u32 queue_depth;	/* writes (and submitted transfers) this fd may have outstanding */
+	__u32 short_policy;	/* USBDRV_SHORT_* */
+	__u32 io_mode;		/* USBDRV_IO_* */
+	__u32 prio;		/* USBDRV_PRIO_*, as set by USBDRV_IOC_SET_PRIO */
+	__u32 read_mode;	/* USBDRV_READ_*, since version 2 */
+	__u32 pm_flags;		/* USBDRV_PM_*, since version 3 */
+	__u32 crc_flags;	/* USBDRV_CRC_*, since version 4 */
+	__u32 reserved[5];
+};
+
+#define USBDRV_MAX_TRANSFER	(64 * 1024)
+
+#define USBDRV_IOC_GET_PARAMS	_IOR(USBDRV_IOC_MAGIC, 7, struct usbdrv_params)
+#define USBDRV_IOC_SET_PARAMS	_IOW(USBDRV_IOC_MAGIC, 8, struct usbdrv_params)
+
+/*
+ * Submit/reap interface: USBDRV_IOC_SUBMIT starts a batch of transfers on
+ * the device's bulk endpoints in one call, USBDRV_IOC_REAP collects a batch
+ * of their completions.  IN data lands in the transfer's buffer at reap time,
+ * so reap from the process that submitted.  OUT transfers share the write
+ * queue with write(), so priority and pacing apply.  poll() reports EPOLLIN
+ * while completions are waiting.
+ */
+enum {
+	USBDRV_XFER_IN = 0,	/* bulk-in endpoint */
+	USBDRV_XFER_OUT = 1,	/* bulk-out endpoint */
+};
+
+struct usbdrv_xfer {
+	__u64 user_data;	/* handed back unchanged in the completion */
+	__u64 buffer;		/* user address of the data */
+	__u32 length;		/* at most USBDRV_MAX_TRANSFER */
+	__u32 dir;		/* USBDRV_XFER_* */
+	__u32 flags;		/* USBDRV_SHORT_* for this transfer */
+	__u32 reserved;
+};
+
+struct usbdrv_submit {
+	__u64 xfers;		/* user address of struct usbdrv_xfer[count] */
+	__u32 count;
+	__u32 submitted;	/* out: transfers started, in array order */
+};
+
+struct usbdrv_completion {
+	__u64 user_data;
+	__s32 status;		/* 0 or a negative errno */
+	__u32 actual_length;
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time of completion */
+};
+
+struct usbdrv_reap {
+	__u64 completions;	/* user address of struct usbdrv_completion[max] */
+	__u32 max;
+	__u32 min_complete;	/* block until this many are ready (at least 1) */
+	__s32 timeout_ms;	/* 0 = don't block, -1 = no timeout */
+	__u32 count;		/* out: completions returned; those past a fault on completions stay queued */
+	__u32 reserved;
+	__u32 reserved2;
+};
+
+#define USBDRV_IOC_SUBMIT	_IOWR(USBDRV_IOC_MAGIC, 9, struct usbdrv_submit)
+#define USBDRV_IOC_REAP		_IOWR(USBDRV_IOC_MAGIC, 10, struct usbdrv_reap)
+
+/*
+ * Striped aggregate, /dev/usbdrv_stripe.  Writes are cut into chunk_size
+ * pieces sent round-robin to the member devices; reads take chunk_size
+ * bytes from each member in the same order.  Members are added and removed
+ * by the minor number of their /dev/usbdrv%d node.  A member that is
+ * unplugged drops out of the rotation and the stripe carries on with the
+ * rest (degraded); the transfer it took down with it fails with -EIO.
+ */
+#define USBDRV_STRIPE_MAX	16
+
+struct usbdrv_stripe_info {
+	__u32 chunk_size;		/* bytes per member per turn */
+	__u32 nr_members;
+	__u32 minor[USBDRV_STRIPE_MAX];	/* members in rotation order */
+	__u32 gone;			/* bitmap of members that were unplugged, by index */
+	__u32 reserved;
+	__u64 read_bytes;
+	__u64 write_bytes;
+};
+
+#define USBDRV_IOC_STRIPE_ADD		_IOW(USBDRV_IOC_MAGIC, 11, __u32)
+#define USBDRV_IOC_STRIPE_DEL		_IOW(USBDRV_IOC_MAGIC, 12, __u32)
+#define USBDRV_IOC_STRIPE_SET_CHUNK	_IOW(USBDRV_IOC_MAGIC, 13, __u32)
+#define USBDRV_IOC_STRIPE_INFO		_IOR(USBDRV_IOC_MAGIC, 14, struct usbdrv_stripe_info)
+
+/*
+ * Bridge: send everything this fd's device receives on its bulk-in endpoint
+ * out of the bulk-out endpoint of the device behind /dev/usbdrv<minor>,
+ * without a trip through userspace.  Received buffers are sent as they are,
+ * so the receive pool bounds what is in flight.  read() on the source fails
+ * with -EBUSY while bridged.  The bridge ends with USBDRV_IOC_BRIDGE_STOP or
+ * when the fd that started it is closed.  Counters are in the source
+ * device's stats.
+ */
+struct usbdrv_bridge {
+	__u32 minor;		/* target /dev/usbdrv%d */
+	__u32 flags;		/* USBDRV_SHORT_ZLP */
+	__u64 reserved;
+};
+
+#define USBDRV_IOC_BRIDGE	_IOW(USBDRV_IOC_MAGIC, 15, struct usbdrv_bridge)
+#define USBDRV_IOC_BRIDGE_STOP	_IO(USBDRV_IOC_MAGIC, 16)
+
+/*
+ * Receive filter: a table of rules run on every transfer completed into the
+ * receive pool, before readers are woken.  The first rule that matches
+ * decides; transfers no rule matches get @default_verdict.  A rule matches
+ * when the transfer length is within [min_len, max_len] and the match_len
+ * bytes at @offset, masked with @mask, equal @value.  Dropped transfers
+ * never reach read(); the tag of a tagged one can be read with
+ * USBDRV_IOC_RX_TAG before reading its data.  The filter is per device and
+ * also applies to bridged data.  Reads done straight into user pages and
+ * USBDRV_IOC_SUBMIT transfers don't pass through it, so the driver stops
+ * taking that path for read() while a filter is set.
+ */
+enum {
+	USBDRV_FILTER_KEEP = 0,
+	USBDRV_FILTER_DROP = 1,
+	USBDRV_FILTER_TAG = 2,		/* keep, with the rule's tag */
+	USBDRV_NR_FILTER_VERDICTS
+};
+
+#define USBDRV_FILTER_MATCH_MAX	8
+#define USBDRV_FILTER_MAX_RULES	64
+
+struct usbdrv_filter_rule {
+	__u32 min_len;
+	__u32 max_len;		/* 0 = no upper bound */
+	__u32 offset;		/* start of the compared bytes; offset + match_len at most rx_buf_size (sysfs) */
+	__u32 match_len;	/* bytes compared, 0 to match on length alone */
+	__u8 mask[USBDRV_FILTER_MATCH_MAX];
+	__u8 value[USBDRV_FILTER_MATCH_MAX];
+	__u32 verdict;		/* USBDRV_FILTER_* */
+	__u32 tag;		/* nonzero, for USBDRV_FILTER_TAG */
+};
+
+struct usbdrv_filter {
+	__u64 rules;		/* user address of struct usbdrv_filter_rule[count] */
+	__u32 count;		/* 0 removes the filter */
+	__u32 default_verdict;	/* USBDRV_FILTER_KEEP or USBDRV_FILTER_DROP */
+	__u64 reserved;
+};
+
+#define USBDRV_IOC_SET_FILTER	_IOW(USBDRV_IOC_MAGIC, 17, struct usbdrv_filter)
+/* tag of the transfer the next read() returns data from, 0 if untagged; -EAGAIN when none is ready */
+#define USBDRV_IOC_RX_TAG	_IOR(USBDRV_IOC_MAGIC, 18, __u32)
+
+/* usbdrv_rx_record.flags */
+#define USBDRV_RX_CRC_BAD	0x1	/* CRC trailer missing or wrong, with USBDRV_CRC_VERIFY_RX */
+
+/*
+ * The received transfer the next read() returns data from.  The data is
+ * delivered whole, trailer included, whatever the flags say.
+ */
+struct usbdrv_rx_record {
+	__u32 length;		/* bytes in the transfer */
+	__u32 offset;		/* bytes of it already read */
+	__u32 tag;		/* as USBDRV_IOC_RX_TAG */
+	__u32 flags;		/* USBDRV_RX_* */
+};
+
+/* -EAGAIN when nothing has been received */
+#define USBDRV_IOC_RX_RECORD	_IOR(USBDRV_IOC_MAGIC, 19, struct usbdrv_rx_record)
+
+/*
+ * Batched control transfers on endpoint 0.  USBDRV_IOC_CTRL_BATCH runs
+ * @count requests, keeping up to @max_inflight of them queued on the host
+ * controller, and returns when all are done with each one's status and
+ * length filled in.  Requests run in array order.  Vendor and class requests
+ * may go either way; standard requests only IN, but for
+ * SET_FEATURE(ENDPOINT_HALT) on this driver's bulk endpoints, which the
+ * driver then recovers from like any stall.  Those addressed to an
+ * interface or endpoint get -EPERM unless it is this driver's.
+ */
+#define USBDRV_CTRL_MAX_BATCH		4096
+#define USBDRV_CTRL_MAX_INFLIGHT	64
+#define USBDRV_CTRL_MAX_DATA		4096
+
+/* usbdrv_ctrl_batch.flags */
+#define USBDRV_CTRL_STOP_ON_ERROR	0x1	/* after a failure, the rest get -ECANCELED */
+
+struct usbdrv_ctrl_xfer {
+	__u8 bRequestType;
+	__u8 bRequest;
+	__u16 wValue;
+	__u16 wIndex;
+	__u16 wLength;		/* data stage bytes, at most USBDRV_CTRL_MAX_DATA */
+	__u32 reserved;
+	__s32 status;		/* out: 0 or a negative errno */
+	__u64 data;		/* user address of the data stage */
+	__u32 actual_length;	/* out */
+	__u32 reserved2;
+};
+
+struct usbdrv_ctrl_batch {
+	__u64 xfers;		/* user address of struct usbdrv_ctrl_xfer[count] */
+	__u32 count;
+	__u32 max_inflight;	/* 0 = module parameter ctrl_in_flight */
+	__u32 timeout_ms;	/* per request, 0 = 5000 */
+	__u32 flags;		/* USBDRV_CTRL_* */
+	__u32 completed;	/* out: requests that succeeded */
+	__u32 reserved;
+};
+
+#define USBDRV_IOC_CTRL_BATCH	_IOWR(USBDRV_IOC_MAGIC, 20, struct usbdrv_ctrl_batch)
+
+#endif /* _USBDRV_IOCTL_H */